@@ -4,6 +4,9 @@
 #include <shared_mutex>
 #include <mutex>
 #include <list>
+#include <vector>
+
+#include "../hazard_pointer.hpp"
 
 using std::shared_lock;
 using std::unique_lock;
@@ -16,12 +19,15 @@ class list {
     T _data;
     list_node *_next;
     list_node *_prev;
+    list *_list;
     std::atomic<size_t> _ref_count;
     std::atomic<bool> _is_deleted;
+    std::atomic<bool> _retired;
     std::shared_mutex _node_lock;
 
-    list_node() : _prev(nullptr), _next(nullptr), _ref_count(0) {}
-    list_node(T data) : list_node() { 
+    list_node() : _next(nullptr), _prev(nullptr), _list(nullptr), _ref_count(0), _is_deleted(false), _retired(false) {}
+    list_node(T data, list *list) : list_node() { 
+        _list = list;
         _data = data; 
     }
 
@@ -39,14 +45,24 @@ class list {
     }
 
     static void release(list_node *n) {
-      n->_ref_count--;
-      if (n->_ref_count == 0) {
-        if (n->_prev)
-            release(n->_prev);
-        if (n->_next)
-            release(n->_next);
-        delete n;
-      }
+      if (n->_list && --n->_ref_count == 0 && !n->_retired.exchange(true))
+        n->_list->_domain.retire(n, &list_node::reclaim);
+    }
+
+    // Called by the hazard domain once no guard protects n. A node captured
+    // again meanwhile goes back to the living and is retired again by its
+    // next release to zero.
+    static void reclaim(void *p) {
+      list_node *n = static_cast<list_node *>(p);
+      n->_retired = false;
+      if (n->_ref_count > 0 || n->_retired.exchange(true))
+        return;
+
+      if (n->_prev)
+          release(n->_prev);
+      if (n->_next)
+          release(n->_next);
+      delete n;
     }
   };
 
@@ -55,17 +71,21 @@ class list {
     using iterator_category = std::bidirectional_iterator_tag;
 
     list_node *ptr;
+    const list *_list = nullptr;
 
-    list_iterator(list_node *ptr) : ptr(ptr) { 
+    list_iterator(list_node *ptr, const list *list) : ptr(ptr), _list(list) { 
         ptr->incRefCount(); 
     }
 
    public:
-    list_iterator(const list_iterator &iter) : ptr(iter.ptr) {
+    list_iterator(const list_iterator &iter) : ptr(iter.ptr), _list(iter._list) {
       ptr->incRefCount();
     }
 
     ~list_iterator() {
+      // keeps ptr alive until the lock below is dropped
+      hazard_pointer::guard g(_list->_domain);
+      g.set(ptr);
       unique_lock lock(ptr->_node_lock);
       list_node::release(ptr);
     }
@@ -81,6 +101,7 @@ class list {
 
       list_node::release(ptr);
       ptr = other.ptr;
+      _list = other._list;
       return *this;
     }
 
@@ -97,19 +118,15 @@ class list {
     }
 
     list_iterator &operator++() {
+      // tmp may be retired by the release below while it is still locked
+      hazard_pointer::guard g(_list->_domain);
+      g.set(ptr);
       shared_lock r_lock(ptr->_node_lock);
       list_node *tmp = ptr;
       list_node *next = ptr->_next;
 
       list_node::capture(&ptr, next);
-
-      if (tmp->_ref_count == 1) {
-        r_lock.unlock();
-        unique_lock w_lock(tmp->_node_lock);
-        list_node::release(tmp);
-      } else {
-        list_node::release(tmp); 
-      }
+      list_node::release(tmp);
 
       return *this;
     }
@@ -121,18 +138,14 @@ class list {
     }
 
     list_iterator &operator--() {
+      hazard_pointer::guard g(_list->_domain);
+      g.set(ptr);
       shared_lock r_lock(ptr->_node_lock);
       list_node *tmp = ptr;
       list_node *prev = ptr->_prev;
 
       list_node::capture(&ptr, prev);
-
-      if (tmp->_ref_count == 1) {
-        r_lock.unlock();
-        unique_lock w_lock(tmp->_node_lock);
-        list_node::release(tmp);
-      } else
-        list_node::release(tmp);
+      list_node::release(tmp);
 
       return *this;
     }
@@ -154,10 +167,14 @@ class list {
 
   list_node *_start;
   list_node *_finish;
+  mutable hazard_pointer::domain _domain;
   std::atomic<size_t> _size = 0;
 
   list_iterator &common_erase(list_iterator &it, bool is_popped) {
     list_node *node = it.ptr;
+    // node may drop its last reference below while still locked
+    hazard_pointer::guard g(_domain);
+    g.set(node);
     bool retry = true;
     while (retry) {
       shared_lock lock_current(node->_node_lock);
@@ -179,7 +196,16 @@ class list {
 
       if (node->_is_deleted) {
         if (is_popped) {
+          // somebody else popped it first, drop what was taken and start over
+          // from the new front
+          lock_next.unlock();
+          lock_current.unlock();
+          lock_prev.unlock();
+          list_node::release(prev);
+          list_node::release(next);
+          shared_lock lock_start(_start->_node_lock);
           node = _start->_next;
+          g.set(node);
           continue;
         }
         list_node::capture(&it.ptr, next);
@@ -203,7 +229,10 @@ class list {
         _size--;
         retry = false;
 
+        // pop_* may have moved on to another node than the one it points at
+        list_node *old = it.ptr;
         list_node::capture(&it.ptr, next);
+        list_node::release(old);
       }
       list_node::release(prev);
       list_node::release(next);
@@ -231,27 +260,41 @@ class list {
   }
 
   ~list() {
-    list_node *node = _start->_next;
-    while (node != _finish) {
-      list_node *buf = node;
-      node = node->_next;
-      list_node::release(buf);
+    // Every node between the sentinels is held by both of its neighbours.
+    // Unlink the whole chain first, so that a node retired (and possibly
+    // reclaimed) by the releases below no longer points at the others.
+    std::vector<list_node *> chain;
+    for (list_node *node = _start->_next; node != _finish; node = node->_next)
+      chain.push_back(node);
+    _start->_next = nullptr;
+    _finish->_prev = nullptr;
+    for (list_node *node : chain) {
+      node->_next = nullptr;
+      node->_prev = nullptr;
+    }
+    for (list_node *node : chain) {
+      list_node::release(node);
+      list_node::release(node);
     }
 
+    // freeing erased nodes releases their old neighbours, keep going until
+    // nothing is left
+    while (_domain.scan() != 0) {}
     delete _start;
     delete _finish;
   }
 
   iterator begin() const {
-    shared_lock lock(_start->_next->_node_lock);
-    if (!_size) 
+    // the first node cannot be unlinked while _start is locked
+    shared_lock lock(_start->_node_lock);
+    if (!_size || _start->_next == _finish) 
         return end();
 
-    return iterator(_start->_next);
+    return iterator(_start->_next, this);
   }
 
   iterator end() const { 
-      return iterator(_finish); 
+      return iterator(_finish, this); 
   }
 
   bool empty() const { 
@@ -263,12 +306,12 @@ class list {
   }
 
   void push_front(const value_type &data) {
-    auto it = iterator(_start);
+    auto it = iterator(_start, this);
     insert(it, data);
   }
 
   void push_back(const value_type &data) {
-    auto it = iterator(_finish->_prev);
+    auto it = iterator(_finish->_prev, this);
     insert(it, data);
   }
 
@@ -276,6 +319,10 @@ class list {
     list_node *prev = iter.ptr;
     if (iter.ptr == _finish)
       throw std::out_of_range("out of range");
+
+    // iter's reference to prev is dropped while prev is still locked
+    hazard_pointer::guard g(_domain);
+    g.set(prev);
     bool retry = true;
     while (retry) {
       if (iter.ptr->_is_deleted) return end();
@@ -286,14 +333,14 @@ class list {
       unique_lock lock_next(next->_node_lock);
 
       if (prev == next->_prev) {
-        list_node *new_node = new list_node(data);
-        unique_lock lock_new(new_node->_node_lock);
-
-        list_node::capture(&prev->_next, new_node);
+        list_node *new_node = new list_node(data, this);
+        // new_node is complete before it is linked in, so it needs no lock
+        // of its own (taking it after prev and next would invert their order)
         list_node::capture(&new_node->_prev, prev);
+        list_node::capture(&new_node->_next, next);
 
+        list_node::capture(&prev->_next, new_node);
         list_node::capture(&next->_prev, new_node);
-        list_node::capture(&new_node->_next, next);
 
         list_node::release(prev);
         list_node::release(next);
@@ -314,7 +361,7 @@ class list {
   }
 
   void pop_back() {
-    auto it = iterator(end().ptr->_prev);
+    auto it = iterator(end().ptr->_prev, this);
     common_erase(it, true);
   }
 
@@ -5,6 +5,9 @@
 #include <mutex>
 #include <shared_mutex>
 #include <thread>
+#include <vector>
+
+#include "../hazard_pointer.hpp"
 
 using std::shared_lock;
 using std::unique_lock;
@@ -15,14 +18,16 @@ class list {
     friend list;
 
     T _data;
-    list_node *_next;
-    list_node *_prev;
+    // written under the node locks, read without them by iterator steps
+    std::atomic<list_node *> _next;
+    std::atomic<list_node *> _prev;
     list *_list;
     std::atomic<size_t> _ref_count;
     std::atomic<bool> _deleted;
+    std::atomic<bool> _retired;
     std::shared_mutex _node_lock;
 
-    list_node() : _prev(nullptr), _next(nullptr), _deleted(false), _ref_count(0) {}
+    list_node() : _next(nullptr), _prev(nullptr), _list(nullptr), _ref_count(0), _deleted(false), _retired(false) {}
     list_node(T data, list *list) : list_node() {
       _list = list;
       _data = data;
@@ -36,131 +41,31 @@ class list {
         _ref_count--; 
     }
 
-    static void capture(list_node **parent, list_node *n) {
+    template <typename Link>
+    static void capture(Link *parent, list_node *n) {
       *parent = n;
       n->_ref_count++;
     }
 
     static void release(list_node *n) {
-      if (n->_list) {
-        shared_lock lock_r(n->_list->global_lock);
-        size_t prev_ref_count = --n->_ref_count;
-        if (prev_ref_count == 0)
-          n->_list->_purgatory->push(n);
-      }
+      if (n->_list && --n->_ref_count == 0 && !n->_retired.exchange(true))
+        n->_list->_domain.retire(n, &list_node::reclaim);
     }
-  };
-
-  class purgatory {
-  public:
-    struct purge_node {
-      list_node *body = nullptr;
-      purge_node *next = nullptr;
-
-      purge_node(list_node *body) : body(body) {}
-    };
-
-  private:
-    friend list;
-
-    list *_valid_list;
-    std::atomic<purge_node *> _head;
-    std::thread _cleaner;
-    bool _destroyed = false;
 
-  public:
-    purgatory(list *list)
-        : _valid_list(list),
-          _head(nullptr),
-          _cleaner(&purgatory::cleaner, this) {}
-
-    ~purgatory() {
-      _destroyed = true;
-      _cleaner.join();
-    }
-
-    void push(list_node *node) {
-      purge_node *pnode = new purge_node(node);
-      do {
-        pnode->next = _head.load();
-      } while (!_head.compare_exchange_strong(pnode->next, pnode));
-    }
-
-    void remove(purge_node *prev, purge_node *pnode) {
-      prev->next = pnode->next;
-      delete pnode;
-    }
-
-    void free_node(purge_node *pnode) {
-      list_node *prev = pnode->body->_prev;
-      list_node *next = pnode->body->_next;
-
-      if (prev != nullptr)
-        prev->release(prev);
-
-      if (next != nullptr)
-        next->release(next);
-
-      delete pnode->body;
-      delete pnode;
-    }
-
-    void cleaner() {
-      do {
-        unique_lock w_lock(_valid_list->global_lock);
-
-        purge_node *purge_start = _head;
-
-        w_lock.unlock();
-
-        if (purge_start != nullptr) {
-          int k = 0;
-          purge_node *prev = purge_start;
-          for (purge_node *pnode = purge_start; pnode != nullptr;) {
-            ++k;
-            purge_node *old_pnode = pnode;
-            pnode = pnode->next;
-
-            if (old_pnode->body->_ref_count > 0 || old_pnode->body->_deleted) {
-              remove(prev, old_pnode);
-            } else {
-              old_pnode->body->_deleted = true;
-              prev = old_pnode;
-            }
-          }
-
-          w_lock.lock();
-          purge_node *new_purge_start = _head;
-
-          if (new_purge_start == purge_start)
-            _head = nullptr;
-
-          w_lock.unlock();
-
-          prev = new_purge_start;
-          purge_node *pnode = new_purge_start;
-          while (pnode != purge_start) {
-            purge_node *old_pnode = pnode;
-            pnode = pnode->next;
-
-            if (old_pnode->body->_deleted)
-              remove(prev, old_pnode);
-            else
-              prev = old_pnode;
-          }
-          prev->next = nullptr;
-
-          for (pnode = purge_start; pnode != nullptr;) {
-            purge_node *old_pnode = pnode;
-            pnode = pnode->next;
-            free_node(old_pnode);
-          }
-        }
-
-        if (!_destroyed)
-          std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-      } while (!_destroyed || _head.load() != nullptr);
+    // Called by the hazard domain once no guard protects n. A reader that had
+    // n guarded may have captured it again meanwhile; such a node goes back
+    // to the living and is retired again by its next release to zero.
+    static void reclaim(void *p) {
+      list_node *n = static_cast<list_node *>(p);
+      n->_retired = false;
+      if (n->_ref_count > 0 || n->_retired.exchange(true))
+        return;
+
+      if (n->_prev != nullptr)
+        release(n->_prev);
+      if (n->_next != nullptr)
+        release(n->_next);
+      delete n;
     }
   };
 
@@ -208,9 +113,9 @@ class list {
     }
 
     list_iterator &operator++() {
-      shared_lock gr_lock(_list->global_lock);
+      hazard_pointer::guard g(_list->_domain);
       list_node *tmp = ptr;
-      list_node *next = ptr->_next;
+      list_node *next = g.protect(ptr->_next);
       list_node::capture(&ptr, next);
       list_node::release(tmp);
       return *this;
@@ -223,9 +128,9 @@ class list {
     }
 
     list_iterator &operator--() {
-      shared_lock gr_lock(_list->global_lock);
+      hazard_pointer::guard g(_list->_domain);
       list_node *tmp = ptr;
-      list_node *prev = ptr->_prev;
+      list_node *prev = g.protect(ptr->_prev);
       list_node::capture(&ptr, prev);
       list_node::release(tmp);
       return *this;
@@ -246,6 +151,9 @@ class list {
     }
 
     ~list_iterator() {
+      // keeps ptr alive until the lock below is dropped
+      hazard_pointer::guard g(_list->_domain);
+      g.set(ptr);
       unique_lock lock(ptr->_node_lock);
       list_node::release(ptr);
     }
@@ -253,12 +161,14 @@ class list {
 
   list_node *_start;
   list_node *_finish;
-  purgatory *_purgatory;
+  mutable hazard_pointer::domain _domain;
   std::atomic<size_t> _size = 0;
-  mutable std::shared_mutex global_lock;
 
   list_iterator &common_erase(list_iterator &it, bool is_popped) {
     list_node *node = it.ptr;
+    // node may drop its last reference below while still locked
+    hazard_pointer::guard g(_domain);
+    g.set(node);
     bool retry = true;
     while (retry) {
       shared_lock lock_current(node->_node_lock);
@@ -279,7 +189,14 @@ class list {
 
       if (node->_deleted) {
         if (is_popped) {
-          node = _start->_next;
+          // somebody else popped it first, drop what was taken and start over
+          // from the new front
+          lock_next.unlock();
+          lock_current.unlock();
+          lock_prev.unlock();
+          list_node::release(prev);
+          list_node::release(next);
+          node = g.protect(_start->_next);
           continue;
         }
         list_node::capture(&it.ptr, next);
@@ -303,7 +220,10 @@ class list {
         _size--;
         retry = false;
 
+        // pop_* may have moved on to another node than the one it points at
+        list_node *old = it.ptr;
         list_node::capture(&it.ptr, next);
+        list_node::release(old);
       }
       list_node::release(prev);
       list_node::release(next);
@@ -317,14 +237,12 @@ class list {
   using value_type = T;
 
   list() : _start(new list_node()), _finish(new list_node()) {
-    _purgatory = new purgatory(this);
     list_node::capture(&_start->_next, _finish);
     list_node::capture(&_finish->_prev, _start);
   }
 
   list(std::initializer_list<value_type> list)
       : _start(new list_node()), _finish(new list_node()) {
-    _purgatory = new purgatory(this);
     list_node::capture(&_start->_next, _finish);
     list_node::capture(&_finish->_prev, _start);
 
@@ -333,23 +251,36 @@ class list {
   }
 
   ~list() {
-    list_node *n = _start->_next;
-    while (n != _finish) {
-      list_node *buf = n;
-      n = n->_next;
-      list_node::release(buf);
+    // Every node between the sentinels is held by both of its neighbours.
+    // Unlink the whole chain first, so that a node retired (and possibly
+    // reclaimed) by the releases below no longer points at the others.
+    std::vector<list_node *> chain;
+    for (list_node *n = _start->_next; n != _finish; n = n->_next)
+      chain.push_back(n);
+    _start->_next = nullptr;
+    _finish->_prev = nullptr;
+    for (list_node *n : chain) {
+      n->_next = nullptr;
+      n->_prev = nullptr;
+    }
+    for (list_node *n : chain) {
+      list_node::release(n);
+      list_node::release(n);
     }
 
+    // freeing erased nodes releases their old neighbours, keep going until
+    // nothing is left
+    while (_domain.scan() != 0) {}
     delete _start;
     delete _finish;
-    delete _purgatory;
   }
 
   iterator begin() const {
-    shared_lock lock(_start->_next->_node_lock);
-    if (!_size) 
+    hazard_pointer::guard g(_domain);
+    list_node *first = g.protect(_start->_next);
+    if (!_size || first == _finish)
         return end();
-    return iterator(_start->_next, this);
+    return iterator(first, this);
   }
 
   iterator end() const { 
@@ -379,6 +310,9 @@ class list {
     if (iter.ptr == _finish)
       throw std::out_of_range("out of range");
 
+    // iter's reference to prev is dropped while prev is still locked
+    hazard_pointer::guard g(_domain);
+    g.set(prev);
     bool retry = true;
     while (retry) {
       if (iter.ptr->_deleted) 
@@ -391,13 +325,13 @@ class list {
 
       if (prev == next->_prev) {
         list_node *new_node = new list_node(data, this);
-        unique_lock lock_new(new_node->_node_lock);
-
-        list_node::capture(&prev->_next, new_node);
+        // new_node is complete before it is linked in, so it needs no lock
+        // of its own (taking it after prev and next would invert their order)
         list_node::capture(&new_node->_prev, prev);
+        list_node::capture(&new_node->_next, next);
 
+        list_node::capture(&prev->_next, new_node);
         list_node::capture(&next->_prev, new_node);
-        list_node::capture(&new_node->_next, next);
 
         list_node::release(prev);
         list_node::release(next);
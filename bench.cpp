@@ -0,0 +1,107 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "consistent_tree.hpp"
+#include "concurrent_skiplist.hpp"
+
+using namespace std;
+
+// 50% lookups, 25% inserts and 25% erases over a preloaded key range,
+// split evenly between `threads` threads
+template<typename Map>
+std::chrono::nanoseconds run_mixed(size_t keys, size_t ops, int threads)
+{
+    Map map;
+    for (size_t i = 0; i < keys; i += 2)
+        map.insert(static_cast<int>(i), static_cast<int>(i));
+
+    vector<thread> workers;
+    auto time_begin = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&map, keys, ops, threads, t]() {
+            std::minstd_rand rng(t + 1);
+            for (size_t j = 0; j < ops / threads; j++)
+            {
+                int key = static_cast<int>(rng() % keys);
+                switch (rng() % 4)
+                {
+                case 0:
+                    map.insert(key, key);
+                    break;
+                case 1:
+                    map.erase(key);
+                    break;
+                default:
+                    map.find(key);
+                }
+            }
+        });
+    }
+    for (auto& w : workers)
+        w.join();
+    auto time_end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time_end - time_begin);
+}
+
+// inserts only, of distinct random keys, split evenly between `threads`
+// threads; with `combining`, through avl_tree's flat-combining writers
+std::chrono::nanoseconds run_ingest(size_t ops, int threads, bool combining)
+{
+    avl_tree<int, int> map;
+    if (combining)
+        map.start_flat_combining();
+
+    vector<thread> workers;
+    auto time_begin = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&map, ops, threads, t]() {
+            std::minstd_rand rng(t + 1);
+            for (size_t j = 0; j < ops / threads; j++)
+            {
+                int key = static_cast<int>(rng() % (ops / threads) * threads + t);
+                map.insert(key, key);
+            }
+        });
+    }
+    for (auto& w : workers)
+        w.join();
+    auto time_end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time_end - time_begin);
+}
+
+int main()
+{
+    size_t keys = 100000;
+    size_t ops = 400000;
+    vector<int> thread_num = { 1, 2, 4, 8, 16, 32, 64 };
+
+    cout << "Threads:  " << std::setw(15) << std::left << "avl_tree, ms"
+         << std::setw(15) << std::left << "skiplist, ms" << '\n';
+    for (int threads : thread_num)
+    {
+        auto tree_time = run_mixed<avl_tree<int, int>>(keys, ops, threads);
+        auto list_time = run_mixed<concurrent_skiplist<int, int>>(keys, ops, threads);
+        cout << std::setw(10) << std::left << threads
+             << std::setw(15) << std::left << tree_time.count() / 1000000
+             << std::setw(15) << std::left << list_time.count() / 1000000 << '\n';
+    }
+
+    cout << "\nIngest:\n";
+    cout << "Threads:  " << std::setw(15) << std::left << "avl_tree, ms"
+         << std::setw(15) << std::left << "combining, ms" << '\n';
+    for (int threads : thread_num)
+    {
+        auto plain_time = run_ingest(ops, threads, false);
+        auto combining_time = run_ingest(ops, threads, true);
+        cout << std::setw(10) << std::left << threads
+             << std::setw(15) << std::left << plain_time.count() / 1000000
+             << std::setw(15) << std::left << combining_time.count() / 1000000 << '\n';
+    }
+    return 0;
+}
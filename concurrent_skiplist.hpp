@@ -0,0 +1,296 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <random>
+#include <vector>
+#include "smart_ptr.hpp"
+
+/**
+ * Lock-free ordered map built as a skip list (Herlihy and Shavit).
+ * Links are atomic_smart_pointers updated with compare-and-swap. Erase first
+ * marks the victim's own links, top level down; marking the bottom one is
+ * what removes the key, and traversals then unlink marked nodes as they pass
+ * them. Nothing is locked. A node stays alive while an iterator points at
+ * it, and an iterator whose node was erased continues from the first key
+ * greater than its own (as avl_tree iterators do).
+ * \param Key The key type. The type (class) must provide a 'less than' operator
+ * \param T The Data type
+ */
+template<typename Key, typename T>
+class concurrent_skiplist
+{
+    static constexpr int max_level = 24;
+
+    struct node {
+        using nodeptr = smart_pointer::SmartPointer<node>;
+        using link = smart_pointer::atomic_smart_pointer<node>;
+
+        Key key;
+        T value;
+        int level;
+        // next[l] is marked once the node is being erased
+        std::vector<link> next;
+
+        node(Key k, T val, int lvl)
+                : key(k), value(val), level(lvl), next(lvl) {}
+    };
+
+    using nodeptr = typename node::nodeptr;
+    using link = typename node::link;
+    nodeptr _head;
+    std::atomic<size_t> _size;
+
+    static nodeptr _load(const link& l) {
+        return l.load();
+    }
+
+    static bool _live(const nodeptr& n) {
+        return !n->next[0].is_marked();
+    }
+
+    // first live node at or after n on the bottom level
+    static nodeptr _skip_dead(nodeptr n) {
+        while (n && !_live(n))
+            n = _load(n->next[0]);
+        return n;
+    }
+
+    // iterator class
+    typedef class tag_skiplist_iterator
+    {
+        nodeptr _pNode;
+        const concurrent_skiplist* _list;
+
+    public:
+        explicit tag_skiplist_iterator(const concurrent_skiplist& list, nodeptr instance = nodeptr(nullptr))
+                : _pNode(instance), _list(&list)
+        { }
+
+        bool operator==(const tag_skiplist_iterator& rhs) const {
+            return _pNode == rhs._pNode;
+        }
+
+        bool operator!=(const tag_skiplist_iterator& rhs) const {
+            return _pNode != rhs._pNode;
+        }
+
+        T& operator*() const {
+            return _pNode->value;
+        }
+
+        T& val() const {
+            return _pNode->value;
+        }
+
+        const Key& key() const {
+            return _pNode->key;
+        }
+
+        // preincrement
+        tag_skiplist_iterator& operator++() {
+            if (!_pNode) return *this;
+            if (_live(_pNode))
+                _pNode = _skip_dead(_load(_pNode->next[0]));
+            else
+                _pNode = _list->_upper_bound(_pNode->key);
+            return *this;
+        }
+
+        // postincrement
+        const tag_skiplist_iterator operator++(int) {
+            tag_skiplist_iterator _copy = *this;
+            ++(*this);
+            return _copy;
+        }
+    } skiplist_iterator;
+
+    friend tag_skiplist_iterator;
+
+public:
+    typedef T                   value_type;
+    typedef Key                 key_type;
+    typedef skiplist_iterator   iterator;
+    typedef size_t              size_type;
+
+    concurrent_skiplist(): _head(smart_pointer::make_smart<node>(Key(), T(), max_level)), _size(0) {
+    }
+
+    concurrent_skiplist(const concurrent_skiplist&) = delete;
+    concurrent_skiplist& operator=(const concurrent_skiplist&) = delete;
+
+    // unlink level by level so that dropping a long list does not recurse
+    // once per node through the SmartPointer destructors
+    ~concurrent_skiplist() {
+        nodeptr n = std::move(_head);
+        while (n) {
+            nodeptr next = n->next[0].exchange(nodeptr(nullptr));
+            for (auto& l : n->next)
+                l.store(nodeptr(nullptr));
+            n = std::move(next);
+        }
+    }
+
+    iterator begin() const {
+        return iterator(*this, _skip_dead(_load(_head->next[0])));
+    }
+
+    iterator end() const {
+        return iterator(*this, nodeptr(nullptr));
+    }
+
+    size_type size() const {
+        return _size;
+    }
+
+    bool empty() const {
+        return _size == 0;
+    }
+
+    iterator find(const key_type& key) const {
+        nodeptr pred = _head;
+        for (int l = max_level - 1; l >= 0; --l) {
+            nodeptr cur = _load(pred->next[l]);
+            while (cur && cur->key < key) {
+                pred = std::move(cur);
+                cur = _load(pred->next[l]);
+            }
+            if (cur && !(key < cur->key) && _live(cur))
+                return iterator(*this, cur);
+        }
+        // The key may still sit behind an erased node with the same key, or
+        // behind nodes inserted after pred since it was read. Walk the bottom
+        // level up to the first greater key.
+        for (nodeptr cur = _load(pred->next[0]); cur && !(key < cur->key); cur = _load(cur->next[0]))
+            if (!(cur->key < key) && _live(cur))
+                return iterator(*this, cur);
+        return end();
+    }
+
+    // inserts (key, val) unless the key is present; returns the key's node
+    iterator insert(const key_type& key, const value_type& val) {
+        int top = _random_level();
+        nodeptr preds[max_level];
+        nodeptr succs[max_level];
+
+        while (true) {
+            if (_find(key, preds, succs))
+                return iterator(*this, succs[0]);
+
+            nodeptr n = smart_pointer::make_smart<node>(key, val, top);
+            for (int l = 0; l < top; ++l)
+                n->next[l].store(succs[l]);
+            // linking the bottom level is what adds the key
+            nodeptr expected = succs[0];
+            if (!preds[0]->next[0].compare_exchange_strong(expected, n))
+                continue;
+            _size++;
+
+            for (int l = 1; l < top; ++l) {
+                while (true) {
+                    // a marked link means an erase got to n first, stop here
+                    bool marked;
+                    nodeptr succ = n->next[l].load(marked);
+                    if (marked)
+                        return iterator(*this, n);
+                    if (succ != succs[l] && !n->next[l].compare_exchange_strong(succ, succs[l]))
+                        return iterator(*this, n);
+                    nodeptr pred_next = succs[l];
+                    if (preds[l]->next[l].compare_exchange_strong(pred_next, n))
+                        break;
+                    _find(key, preds, succs);
+                    if (succs[0] != n)
+                        return iterator(*this, n);
+                }
+            }
+            return iterator(*this, n);
+        }
+    }
+
+    bool erase(const key_type& key) {
+        nodeptr preds[max_level];
+        nodeptr succs[max_level];
+        if (!_find(key, preds, succs))
+            return false;
+
+        nodeptr victim = succs[0];
+        for (int l = victim->level - 1; l >= 1; --l)
+            while (!victim->next[l].is_marked())
+                victim->next[l].try_mark(victim->next[l].load());
+
+        // whoever marks the bottom level erases the key
+        while (true) {
+            nodeptr succ = victim->next[0].load();
+            if (victim->next[0].try_mark(succ)) {
+                _size--;
+                // unlinks the victim on every level
+                _find(key, preds, succs);
+                return true;
+            }
+            if (victim->next[0].is_marked())
+                return false;
+        }
+    }
+
+    bool erase(iterator position) {
+        return erase(position.key());
+    }
+
+    // Helper functions
+private:
+    static int _random_level() {
+        thread_local std::minstd_rand rng(std::random_device{}());
+        int level = 1;
+        while (level < max_level && (rng() & 1))
+            ++level;
+        return level;
+    }
+
+    // Fills preds/succs with the last node before `key` and its successor on
+    // every level, unlinking the marked nodes it passes; returns whether the
+    // key is present (succs[0] holds it, unmarked).
+    bool _find(const key_type& key, nodeptr* preds, nodeptr* succs) const {
+        while (!_try_find(key, preds, succs)) {}
+        return succs[0] && !(key < succs[0]->key);
+    }
+
+    // one pass of _find; fails when a predecessor changed under it
+    bool _try_find(const key_type& key, nodeptr* preds, nodeptr* succs) const {
+        nodeptr pred = _head;
+        for (int l = max_level - 1; l >= 0; --l) {
+            nodeptr cur = _load(pred->next[l]);
+            while (cur) {
+                bool marked;
+                nodeptr succ = cur->next[l].load(marked);
+                if (marked) {
+                    nodeptr expected = cur;
+                    if (!pred->next[l].compare_exchange_strong(expected, succ))
+                        return false;
+                    cur = std::move(succ);
+                    continue;
+                }
+                if (!(cur->key < key))
+                    break;
+                pred = std::move(cur);
+                cur = std::move(succ);
+            }
+            preds[l] = pred;
+            succs[l] = cur;
+        }
+        return true;
+    }
+
+    // first live node with a key greater than `key`
+    nodeptr _upper_bound(const key_type& key) const {
+        nodeptr pred = _head;
+        nodeptr cur;
+        for (int l = max_level - 1; l >= 0; --l) {
+            cur = _load(pred->next[l]);
+            while (cur && !(key < cur->key)) {
+                pred = std::move(cur);
+                cur = _load(pred->next[l]);
+            }
+        }
+        return _skip_dead(cur);
+    }
+};
@@ -1,57 +1,249 @@
+#pragma once
+
 #include <cstdint>
 #include <cstddef>
+#include "frozen_tree.hpp"
 #include "smart_ptr.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 /**
+ * Thread-safe AVL map with heap-allocated, reference-counted nodes; see
+ * static_avl_tree.hpp for the fixed-capacity variant.
  * \param Key The key type. The type (class) must provide a 'less than' and 'equal to' operator
  * \param T The Data type
- * \param size_type Container size type
- * \param Size Container size
- * \param Fast If true every node stores an extra parent index. This increases memory but speed up insert/erase by factor 10
+ * \param Policy smart_pointer::multi_threaded, or smart_pointer::single_threaded for a tree that never leaves its
+ *               thread: plain reference counts and no locking at all
  */
 
 using smart_pointer::SmartPointer;
+using smart_pointer::make_smart;
 using std::shared_mutex;
 using std::shared_lock;
 using std::unique_lock;
 
-template<typename Key, typename T>
+template<typename Key, typename T, typename Policy = smart_pointer::multi_threaded>
 class avl_tree
 {
     typedef struct node {
-        bool deleted;
+        using nodeptr = SmartPointer<node, Policy>;
+        nodeptr left;
+        nodeptr right;
 
+        // nodes in this subtree, for split/join
+        size_t count;
         Key key;
         T value;
         int height;
-        using nodeptr = SmartPointer<node>;
-        nodeptr left;
-        nodeptr right;
+        bool deleted;
 
-        node(Key k, T val){key = k; value = val; left = right = NULL; height = 1; deleted = false;}
+        node(Key k, T val){key = k; value = val; left = right = NULL; count = 1; height = 1; deleted = false;}
     } node;
     
-    using nodeptr = SmartPointer<node>;
+    using nodeptr = SmartPointer<node, Policy>;
+    // Size budget for <int, int>: two one-pointer links, the subtree count,
+    // key and value, and one word for height and the erased flag.
+    static constexpr size_t _int_node_size = sizeof(void*) == 8 ? 40 : 28;
+    static_assert(!(std::is_same_v<Key, int> && std::is_same_v<T, int>) || sizeof(node) <= _int_node_size,
+                  "avl_tree<int, int> node exceeds its size budget");
+    using mutex_type = typename Policy::mutex_type;
     nodeptr _tree;
     size_t _size = 0;
-    mutable shared_mutex _mutex;
+    mutable mutex_type _mutex;
+    // bumped whenever nodes are detached or relinked in bulk (clear, split,
+    // join), so iterators know their node's links may be gone
+    std::atomic<size_t> _epoch = 0;
+    // smallest and largest node, kept up to date by every insert and erase
+    nodeptr _leftmost;
+    nodeptr _rightmost;
+
+    // update posted by post_insert/post_erase, waiting to be folded into the tree
+    struct delta {
+        bool erase;
+        Key key;
+        T value;
+        delta* next;
+
+        delta(bool erase, const Key& key, const T& value)
+                : erase(erase), key(key), value(value), next(nullptr) {}
+    };
+
+    // periodically folds posted updates into the tree
+    class consolidator {
+        avl_tree* _owner;
+        std::mutex _m;
+        std::condition_variable _cv;
+        bool _destroyed = false;
+        std::thread _worker;
+
+        void run(std::chrono::milliseconds period) {
+            unique_lock lock(_m);
+            while (!_cv.wait_for(lock, period, [this] { return _destroyed; })) {
+                lock.unlock();
+                _owner->consolidate();
+                lock.lock();
+            }
+        }
+
+    public:
+        consolidator(avl_tree* owner, std::chrono::milliseconds period)
+                : _owner(owner), _worker(&consolidator::run, this, period) {}
+
+        ~consolidator() {
+            {
+                std::lock_guard lock(_m);
+                _destroyed = true;
+            }
+            _cv.notify_one();
+            _worker.join();
+        }
+    };
+
+    // newest first; the single mapping-table entry of the whole tree
+    std::atomic<delta*> _deltas = nullptr;
+    std::unique_ptr<consolidator> _consolidator;
+
+    // an insert or erase published by one thread for the combiner to apply
+    struct alignas(64) combining_slot {
+        enum { free, pending, done };
+
+        std::atomic<bool> owned = false;
+        std::atomic<int> state = free;
+        bool erase = false;
+        Key key;
+        T value;
+        // results: the key's node (insert) and whether anything changed
+        nodeptr node;
+        bool changed = false;
+    };
+
+    static constexpr size_t _combining_slots = 64;
+    // a waiter checks its own slot this often between tries for the lock
+    static constexpr size_t _combining_spins = 64;
+    std::unique_ptr<combining_slot[]> _slots;
+    std::atomic<bool> _flat_combining = false;
+
+    // holds the tree's read lock and the node for as long as it lives
+    class value_guard
+    {
+        shared_lock<mutex_type> _lock;
+        nodeptr _pNode;
+
+    public:
+        value_guard(mutex_type& m, const nodeptr& instance)
+                : _lock(m), _pNode(instance)
+        { }
+
+        const T& operator*() const {
+            return _pNode->value;
+        }
+
+        const T* operator->() const {
+            return &_pNode->value;
+        }
+
+        const Key& key() const {
+            return _pNode->key;
+        }
+    };
+
+    class tag_avl_tree_reverse_iterator;
 
     // iterator class
     typedef class tag_avl_tree_iterator
     {
+        friend avl_tree;
+        friend tag_avl_tree_reverse_iterator;
+
         nodeptr _pNode;
+        // position, to find the neighbours once the node is unlinked
+        Key _key;
+        size_t _epoch;
         avl_tree& _tree;
 
+        const nodeptr& _node() const {
+            if (!_pNode)
+                throw smart_pointer::exception();
+            return _pNode;
+        }
+
+        void _assign(const nodeptr& n) {
+            _pNode = n;
+            _key = n ? n->key : Key();
+            _epoch = _tree._epoch;
+        }
+
+        // the node is still linked into the tree, so its children can be followed
+        bool _attached(const nodeptr& n) const {
+            return n && !n->deleted && _epoch == _tree._epoch;
+        }
+
+        // requires the unique lock
+        void _increment() {
+            _tree._apply_deltas();
+            if (!_pNode) return;
+            nodeptr n = _pNode;
+            if (_attached(n) && n->right) {
+                n = n->right;
+                while (n->left)
+                    n = n->left;
+            } else {
+                n = _tree._successor(_key);
+            }
+            _assign(n);
+            // the next increment starts at the right child, so start loading
+            // it while the caller works on the current value
+            if (n)
+                _prefetch(n->right);
+        }
+
+        // requires the unique lock; end() steps to the largest element
+        void _decrement() {
+            _tree._apply_deltas();
+            if (!_pNode) {
+                _assign(_tree._rightmost);
+                return;
+            }
+            nodeptr n = _pNode;
+            if (_attached(n) && n->left) {
+                n = n->left;
+                while (n->right)
+                    n = n->right;
+            } else {
+                n = _tree._predecessor(_key);
+            }
+            _assign(n);
+            if (n)
+                _prefetch(n->left);
+        }
+
     public:
         // ctor
-        explicit tag_avl_tree_iterator(avl_tree& tree, nodeptr instance = nullptr)
-                : _pNode(instance), _tree(tree)
+        explicit tag_avl_tree_iterator(avl_tree& tree, const nodeptr& instance = nodeptr(nullptr))
+                : _pNode(instance), _key(instance ? instance->key : Key()), _epoch(tree._epoch), _tree(tree)
         { }
 
+        tag_avl_tree_iterator(const tag_avl_tree_iterator&) = default;
+
         tag_avl_tree_iterator& operator=(const tag_avl_tree_iterator& other) {
             _pNode = other._pNode;
+            _key = other._key;
+            _epoch = other._epoch;
             return *this;
         }
 
@@ -63,102 +255,174 @@ class avl_tree
             return _pNode != rhs._pNode;
         }
 
+        // The iterator keeps its node alive, so the reference stays valid even
+        // after erase. An erased node drops its links to the rest of the tree,
+        // so it pins only itself, and stepping from it continues from its key.
+        // The tree lock is not held while the caller uses the reference: a
+        // concurrent write to the same value is a race, use load() or guard().
+
         // dereference - access value
         T& operator*() const {
-            shared_lock lock(_tree._mutex);
-            return _pNode->value;
+            return _node()->value;
         }
 
         // access value
         T& val() const {
-            shared_lock lock(_tree._mutex);
-            return _pNode->value;
+            return _node()->value;
+        }
+
+        // access key (a node's key never changes)
+        const Key& key() const {
+            return _key;
         }
 
-        // access key
-        Key& key() const {
+        // copy of the value taken under the tree's read lock
+        T load() const {
             shared_lock lock(_tree._mutex);
-            return _pNode->key;
+            return _node()->value;
+        }
+
+        // reference to the value that keeps the tree's read lock and the node
+        // until the guard is destroyed
+        value_guard guard() const {
+            return value_guard(_tree._mutex, _node());
         }
 
         // preincrement
         tag_avl_tree_iterator& operator++() {
             unique_lock lock(_tree._mutex);
-            if(!_pNode) return *this;
-            if (!_pNode->deleted && _pNode->right) {
-                _pNode = _pNode->right;
-                while (_pNode->left)
-                    _pNode = _pNode->left;
-                return *this;
-            } else {
-                nodeptr q = _tree._tree->left; // get start node
-                nodeptr suc;
-
-                while (q) {
-                    if (q->key > _pNode->key) {
-                        suc = q;
-                        q = q->left;
-                    } else if (q->key < _pNode->key)
-                        q = q->right;
-                    else
-                        break;
-                }
-                _pNode = suc;
-                return *this;
-            }
+            _increment();
+            return *this;
         }
         // postincrement
         const tag_avl_tree_iterator operator++(int) {
+            unique_lock lock(_tree._mutex);
             tag_avl_tree_iterator _copy = *this;
-            ++(*this);
+            _increment();
             return _copy;
         }
 
         tag_avl_tree_iterator operator--() {
             unique_lock lock(_tree._mutex);
-            if(!_pNode) return *this;
-            if (!_pNode->deleted && _pNode->left) {
-                _pNode = _pNode->left;
-                while (_pNode->right)
-                    _pNode = _pNode->right;
-                return *this;
-            }
-            else {
-                nodeptr q = _tree._tree->left; // get start node
-                nodeptr suc;
-
-                while (q) {
-                    if (q->key < _pNode->key) {
-                        suc = q;
-                        q = q->right;
-                    }
-                    else if (q->key > _pNode->key)
-                        q = q->left;
-                    else
-                        break;
-                }
-                _pNode = suc;
-                return *this;
-
-            }
+            _decrement();
+            return *this;
         }
 
         const tag_avl_tree_iterator operator--(int) {
+            unique_lock lock(_tree._mutex);
             tag_avl_tree_iterator _copy = *this;
-            --(*this);
+            _decrement();
             return _copy;
         }
     } avl_tree_iterator;
 
+    // Walks from the largest key down. It points at its element itself (no
+    // off-by-one as with std::reverse_iterator), so it is erase-safe and steps
+    // at the same cost as the forward iterator.
+    typedef class tag_avl_tree_reverse_iterator
+    {
+        tag_avl_tree_iterator _base;
+
+        bool _at_end() const {
+            return !_base._pNode;
+        }
+
+    public:
+        explicit tag_avl_tree_reverse_iterator(const tag_avl_tree_iterator& base)
+                : _base(base)
+        { }
+
+        tag_avl_tree_reverse_iterator(const tag_avl_tree_reverse_iterator&) = default;
+        tag_avl_tree_reverse_iterator& operator=(const tag_avl_tree_reverse_iterator&) = default;
+
+        // forward iterator at the same element
+        const tag_avl_tree_iterator& base() const {
+            return _base;
+        }
+
+        bool operator==(const tag_avl_tree_reverse_iterator& rhs) const {
+            return _base == rhs._base;
+        }
+
+        bool operator!=(const tag_avl_tree_reverse_iterator& rhs) const {
+            return _base != rhs._base;
+        }
+
+        T& operator*() const {
+            return *_base;
+        }
+
+        T& val() const {
+            return _base.val();
+        }
+
+        const Key& key() const {
+            return _base.key();
+        }
+
+        T load() const {
+            return _base.load();
+        }
+
+        value_guard guard() const {
+            return _base.guard();
+        }
+
+        // preincrement: the next smaller key
+        tag_avl_tree_reverse_iterator& operator++() {
+            unique_lock lock(_base._tree._mutex);
+            if (!_at_end())
+                _base._decrement();
+            return *this;
+        }
+
+        // postincrement
+        const tag_avl_tree_reverse_iterator operator++(int) {
+            unique_lock lock(_base._tree._mutex);
+            tag_avl_tree_reverse_iterator _copy = *this;
+            if (!_at_end())
+                _base._decrement();
+            return _copy;
+        }
+
+        // rend() steps to the smallest element
+        tag_avl_tree_reverse_iterator& operator--() {
+            unique_lock lock(_base._tree._mutex);
+            _step_back();
+            return *this;
+        }
+
+        const tag_avl_tree_reverse_iterator operator--(int) {
+            unique_lock lock(_base._tree._mutex);
+            tag_avl_tree_reverse_iterator _copy = *this;
+            _step_back();
+            return _copy;
+        }
+
+    private:
+        // requires the unique lock
+        void _step_back() {
+            if (_at_end()) {
+                _base._tree._apply_deltas();
+                _base._assign(_base._tree._leftmost);
+            } else {
+                _base._increment();
+            }
+        }
+    } avl_tree_reverse_iterator;
+
     friend tag_avl_tree_iterator;
+    friend tag_avl_tree_reverse_iterator;
 public:
 
     typedef T                   value_type;
     typedef Key                 key_type;
     typedef avl_tree_iterator   iterator;
+    typedef avl_tree_reverse_iterator reverse_iterator;
+    typedef value_guard         guard_type;
     typedef size_t              size_type;
 
-    avl_tree(): _tree(new node(Key(), T())), _size(0) {
+    avl_tree(): _tree(make_smart<node, Policy>(Key(), T())), _size(0) {
 
     }
     avl_tree(avl_tree& tree): avl_tree() {
@@ -169,10 +433,52 @@ public:
             it++;
         }
     }
+
+    // Builds the tree from an unsorted range of (key, value) pairs with
+    // `threads` threads: a parallel stable sort, dropping repeated keys (the
+    // first occurrence wins, as with insert), then a balanced tree built
+    // bottom-up with both halves of every level in parallel.
+    template<typename InputIt>
+    avl_tree(InputIt first, InputIt last, unsigned threads = std::thread::hardware_concurrency()): avl_tree() {
+        if (!Policy::thread_safe || threads == 0)
+            threads = 1;
+        std::vector<std::pair<Key, T>> items(first, last);
+        _parallel_sort(items, threads);
+        auto end = std::unique(items.begin(), items.end(), [](const auto& a, const auto& b) {
+            return !(a.first < b.first) && !(b.first < a.first);
+        });
+        items.erase(end, items.end());
+
+        int depth = 0;
+        for (unsigned n = threads; n > 1; n >>= 1)
+            ++depth;
+        _tree->left = _build(items, 0, items.size(), depth);
+        _reset_bounds();
+    }
+
+    // takes over other's elements; other is left empty
+    avl_tree(avl_tree&& other): avl_tree() {
+        nodeptr root = other._detach();
+        _tree->left = std::move(root);
+        _reset_bounds();
+    }
+
+    ~avl_tree() {
+        _consolidator.reset();
+        for (delta* d = _deltas.exchange(nullptr); d != nullptr; ) {
+            delta* next = d->next;
+            delete d;
+            d = next;
+        }
+        _dispose(std::move(_tree));
+    }
+
     // iterators
     iterator begin()
     {
-        return iterator(*this, _findmin(_tree->left));
+        _fold_deltas();
+        shared_lock lock(_mutex);
+        return iterator(*this, _leftmost);
     }
 
     iterator end()
@@ -180,6 +486,18 @@ public:
         return iterator(*this, nodeptr(nullptr));
     }
 
+    reverse_iterator rbegin()
+    {
+        _fold_deltas();
+        shared_lock lock(_mutex);
+        return reverse_iterator(iterator(*this, _rightmost));
+    }
+
+    reverse_iterator rend()
+    {
+        return reverse_iterator(end());
+    }
+
     size_type size() const {
         shared_lock lock(_mutex);
         return _size;
@@ -190,10 +508,19 @@ public:
         return _size == static_cast<size_type>(0);
     }
     
+    // O(1) under the lock: the old nodes are detached and freed afterwards,
+    // without blocking readers
     void clear() {
-        unique_lock lock(_mutex);
-        _size = 0U;
-        _tree->left = NULL;
+        nodeptr root, leftmost, rightmost;
+        {
+            unique_lock lock(_mutex);
+            _size = 0U;
+            root = std::move(_tree->left);
+            leftmost = std::move(_leftmost);
+            rightmost = std::move(_rightmost);
+            _epoch++;
+        }
+        _dispose(std::move(root));
     }
 
     T& operator[](const key_type& k) {
@@ -207,38 +534,768 @@ public:
     }
     
     iterator insert(const key_type& key, const value_type& val) {
+        if (_flat_combining.load(std::memory_order_relaxed))
+            return iterator(*this, _publish(false, key, val).first);
         unique_lock lock(_mutex);
-        if(_tree->left) {
-            auto res = iterator(*this, _find(_tree->left, key));
-            if(res != end()) return res;
-        }
-        _tree->left = _insert(_tree->left, key, val);
-        _size++;
-        return iterator(*this, _find(_tree->left,key));
+        _apply_deltas();
+        return iterator(*this, _emplace(key, [&val]() -> const T& { return val; }).first);
+    }
+
+    // Read-modify-write in one descent, with fn(value) called under the
+    // tree's write lock (fn must not use the tree itself).
+
+    // applies fn to the key's value, inserting T() first if the key is absent;
+    // returns whether it was inserted
+    template<typename F>
+    bool upsert(const key_type& key, F fn) {
+        unique_lock lock(_mutex);
+        _apply_deltas();
+        auto [n, added] = _emplace(key, []() { return T(); });
+        fn(n->value);
+        return added;
+    }
+
+    // applies fn to the key's value; false if the key is absent
+    template<typename F>
+    bool modify(const key_type& key, F fn) {
+        unique_lock lock(_mutex);
+        _apply_deltas();
+        const nodeptr* n = _lower_bound(_tree->left, key);
+        if (!n || key < (*n)->key)
+            return false;
+        fn((*n)->value);
+        return true;
+    }
+
+    // inserts factory() unless the key is present (factory is not called
+    // then); returns a copy of the key's value
+    template<typename F>
+    T compute_if_absent(const key_type& key, F factory) {
+        unique_lock lock(_mutex);
+        _apply_deltas();
+        return _emplace(key, factory).first->value;
+    }
+
+    // smallest element, or end(); same as begin()
+    iterator min() {
+        return begin();
+    }
+
+    // largest element, or end()
+    iterator max() {
+        _fold_deltas();
+        shared_lock lock(_mutex);
+        return iterator(*this, _rightmost);
+    }
+
+    // removes the smallest element and returns it, for queue-like use
+    std::optional<std::pair<Key, T>> pop_min() {
+        unique_lock lock(_mutex);
+        _apply_deltas();
+        return _pop(_leftmost);
+    }
+
+    std::optional<std::pair<Key, T>> pop_max() {
+        unique_lock lock(_mutex);
+        _apply_deltas();
+        return _pop(_rightmost);
     }
     
     iterator find(const key_type& key) {
+        _fold_deltas();
         shared_lock lock(_mutex);
         if(!_tree->left) return end();
         return iterator(*this, _find(_tree->left,key));
     }
+
+    // first element whose key is not less than `key`
+    iterator lower_bound(const key_type& key) {
+        _fold_deltas();
+        shared_lock lock(_mutex);
+        const nodeptr* n = _lower_bound(_tree->left, key);
+        return iterator(*this, n ? *n : nodeptr(nullptr));
+    }
+
+    // read-only copy of the current contents in a contiguous, lock-free
+    // layout (see frozen_tree.hpp), for tables that are only read from now on
+    frozen_tree<Key, T> freeze() {
+        _fold_deltas();
+        std::vector<Key> keys;
+        std::vector<T> values;
+        {
+            shared_lock lock(_mutex);
+            keys.reserve(_size);
+            values.reserve(_size);
+            std::vector<const node*> stack;
+            const node* n = _tree->left.get();
+            while (n || !stack.empty()) {
+                for (; n; n = n->left.get())
+                    stack.push_back(n);
+                n = stack.back();
+                stack.pop_back();
+                keys.push_back(n->key);
+                values.push_back(n->value);
+                n = n->right.get();
+            }
+        }
+        return frozen_tree<Key, T>(keys, values);
+    }
     
     bool erase(const key_type& key) {
+        if (_flat_combining.load(std::memory_order_relaxed))
+            return _publish(true, key, T()).second;
         unique_lock lock(_mutex);
-        _tree->left = _remove(_tree->left, key);
-        _size--;
-        return true;
+        _apply_deltas();
+        return _erase(key);
     }
     
     bool erase(iterator position) {
+        // end() carries no key of its own
+        if (!position._pNode)
+            return false;
+        return erase(position._key);
+    }
+
+    // Erases every key in [first, last) and returns how many there were:
+    // two splits and a join, O(log n) under the lock; the erased nodes are
+    // freed after it is released.
+    size_type erase(const key_type& first, const key_type& last) {
+        nodeptr middle;
+        size_type erased;
+        {
+            unique_lock lock(_mutex);
+            _apply_deltas();
+            nodeptr left, rest, right;
+            _split(std::move(_tree->left), first, left, rest);
+            _split(std::move(rest), last, middle, right);
+            erased = _count(middle);
+            _tree->left = _join2(std::move(left), std::move(right));
+            _reset_bounds();
+        }
+        _dispose(std::move(middle));
+        return erased;
+    }
+
+    // Moves every key not less than `key` into a new tree and returns it.
+    // O(log n) under this tree's lock.
+    avl_tree split(const key_type& key) {
+        avl_tree res;
+        nodeptr left, right;
+        {
+            unique_lock lock(_mutex);
+            _apply_deltas();
+            _split(std::move(_tree->left), key, left, right);
+            _tree->left = std::move(left);
+            _reset_bounds();
+        }
+        res._tree->left = std::move(right);
+        res._reset_bounds();
+        return res;
+    }
+
+    // Calls fn(key, value) for every element from `threads` threads, the
+    // calling one included. The subtree counts cut the tree into contiguous key
+    // ranges of about equal size, each walked in key order by one thread,
+    // under the tree's read lock throughout (fn must not use the tree itself).
+    // fn is called concurrently; the first exception it throws is rethrown
+    // here once every thread is done.
+    template<typename F>
+    void parallel_for_each(F fn, unsigned threads = std::thread::hardware_concurrency()) {
+        _fold_deltas();
+        shared_lock lock(_mutex);
+        if (_size == 0) return;
+        if (!Policy::thread_safe || threads == 0)
+            threads = 1;
+
+        // a few pieces per thread, so the ranges can be evened out
+        std::vector<scan_piece> pieces;
+        _partition(_tree->left.get(), std::max<size_t>(1, _size / (threads * 4)), pieces);
+        size_t per_thread = (_size + threads - 1) / threads;
+        std::vector<size_t> cuts = {0};
+        size_t acc = 0;
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            acc += pieces[i].subtree ? pieces[i].n->count : 1;
+            if (acc >= per_thread && cuts.size() < threads) {
+                cuts.push_back(i + 1);
+                acc = 0;
+            }
+        }
+        if (cuts.back() != pieces.size())
+            cuts.push_back(pieces.size());
+
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto scan = [&](size_t from, size_t to) {
+            try {
+                for (size_t i = from; i < to; ++i)
+                    _scan(pieces[i], fn);
+            } catch (...) {
+                std::lock_guard guard(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t k = 1; k + 1 < cuts.size(); ++k)
+            workers.emplace_back(scan, cuts[k], cuts[k + 1]);
+        scan(cuts[0], cuts[1]);
+        for (auto& w : workers)
+            w.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Set operations that consume other (it is left empty). They are the
+    // join-based divide and conquer: split this tree by other's root, recurse
+    // on both sides and join the results, O(m log(n/m + 1)) work for trees of
+    // m <= n elements. While the subproblems are big enough both sides run in
+    // parallel. Both locks are taken, other's only to detach its root.
+
+    // union; where both trees have a key, other's value wins
+    void merge(avl_tree& other) {
+        if (&other != this)
+            _combine(other, &avl_tree::_union);
+    }
+
+    // keeps the elements of this tree whose keys are in other
+    void intersect(avl_tree& other) {
+        if (&other != this)
+            _combine(other, &avl_tree::_intersection);
+    }
+
+    // removes the keys that are in other
+    void subtract(avl_tree& other) {
+        if (&other != this)
+            _combine(other, &avl_tree::_difference);
+        else
+            clear();
+    }
+
+    // Moves all of other's elements into this tree. Every key of one tree must
+    // be less than every key of the other, otherwise std::invalid_argument is
+    // thrown and nothing changes. O(log n); other's lock is held only to
+    // detach its root.
+    void join(avl_tree& other) {
+        if (&other == this)
+            return;
+        unique_lock lock(_mutex, std::defer_lock);
+        unique_lock other_lock(other._mutex, std::defer_lock);
+        std::lock(lock, other_lock);
+        _apply_deltas();
+        other._apply_deltas();
+        if (!other._tree->left)
+            return;
+        bool after = !_tree->left || _rightmost->key < other._leftmost->key;
+        if (!after && !(other._rightmost->key < _leftmost->key))
+            throw std::invalid_argument("avl_tree::join: key ranges overlap");
+        nodeptr root = std::move(other._tree->left);
+        other._reset_bounds();
+        other_lock.unlock();
+
+        if (after)
+            _tree->left = _join2(std::move(_tree->left), std::move(root));
+        else
+            _tree->left = _join2(std::move(root), std::move(_tree->left));
+        _reset_bounds();
+    }
+
+    // Latch-free updates, Bw-tree style: the update is appended to the delta
+    // chain with a single CAS and folded into the tree later by consolidate(),
+    // the background consolidator, or the next reader or locked writer.
+    // post_insert assigns the value when the key is already present.
+    // size() and empty() only count folded updates.
+    void post_insert(const key_type& key, const value_type& val) {
+        _post(new delta(false, key, val));
+    }
+
+    void post_erase(const key_type& key) {
+        _post(new delta(true, key, T()));
+    }
+
+    // folds every posted update into the tree in the order they were posted
+    void consolidate() {
+        if (_deltas.load(std::memory_order_acquire) == nullptr) return;
         unique_lock lock(_mutex);
-        _tree->left = _remove(_tree->left, position._pNode->key);
-        _size--;
-        return true;
+        _apply_deltas();
+    }
+
+    // runs consolidate() every `period` on a background thread
+    void start_consolidator(std::chrono::milliseconds period) {
+        static_assert(Policy::thread_safe, "a single_threaded tree cannot be consolidated in the background");
+        _consolidator = std::make_unique<consolidator>(this, period);
+    }
+
+    void stop_consolidator() {
+        _consolidator.reset();
+    }
+
+    // Flat combining for many concurrent writers: insert() and erase(key)
+    // publish their request in a slot, and whichever thread gets the write
+    // lock applies every pending request in one pass, sorted by key, while the
+    // others wait for their result instead of queueing on the lock. Start it
+    // before the tree is shared between threads.
+    void start_flat_combining() {
+        static_assert(Policy::thread_safe, "a single_threaded tree has no concurrent writers to combine");
+        if (!_slots)
+            _slots = std::make_unique<combining_slot[]>(_combining_slots);
+        _flat_combining = true;
+    }
+
+    void stop_flat_combining() {
+        _flat_combining = false;
     }
     
+    // Looks up every key of `keys`. Up to `group` descents advance in lockstep,
+    // one level at a time, so the cache misses of independent lookups overlap
+    // instead of being paid one after another.
+    std::vector<iterator> find_batch(const std::vector<key_type>& keys) {
+        static constexpr size_t group = 8;
+        struct cursor {
+            const nodeptr* n;
+            const nodeptr* candidate;
+        };
+
+        std::vector<iterator> res;
+        res.reserve(keys.size());
+        _fold_deltas();
+        shared_lock lock(_mutex);
+        for (size_t first = 0; first < keys.size(); first += group) {
+            size_t count = std::min(group, keys.size() - first);
+            cursor cur[group];
+            for (size_t i = 0; i < count; ++i)
+                cur[i] = cursor{&_tree->left, nullptr};
+
+            for (bool active = true; active; ) {
+                active = false;
+                for (size_t i = 0; i < count; ++i) {
+                    cursor& c = cur[i];
+                    if (!*c.n) continue;
+                    node* p = c.n->get();
+                    bool go_right = p->key < keys[first + i];
+                    c.candidate = go_right ? c.candidate : c.n;
+                    c.n = go_right ? &p->right : &p->left;
+                    _prefetch(*c.n);
+                    active = true;
+                }
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                const nodeptr* c = cur[i].candidate;
+                if (!c || keys[first + i] < (*c)->key)
+                    res.push_back(end());
+                else
+                    res.push_back(iterator(*this, *c));
+            }
+        }
+        return res;
+    }
+
     // Helper functions
 private:
+    void _post(delta* d) {
+        d->next = _deltas.load(std::memory_order_relaxed);
+        while (!_deltas.compare_exchange_weak(d->next, d, std::memory_order_release,
+                                              std::memory_order_relaxed));
+    }
+
+    // readers fold pending updates first so that they see their own posts
+    void _fold_deltas() {
+        if (_deltas.load(std::memory_order_acquire) != nullptr)
+            consolidate();
+    }
+
+    // requires the unique lock
+    void _apply_deltas() {
+        if (_deltas.load(std::memory_order_acquire) == nullptr) return;
+        delta* chain = _deltas.exchange(nullptr, std::memory_order_acquire);
+        delta* ordered = nullptr;
+        while (chain != nullptr) {
+            delta* next = chain->next;
+            chain->next = ordered;
+            ordered = chain;
+            chain = next;
+        }
+        while (ordered != nullptr) {
+            delta* d = ordered;
+            ordered = d->next;
+            if (d->erase) {
+                _erase(d->key);
+            } else {
+                bool added = !_tree->left || !_find(_tree->left, d->key);
+                _tree->left = _insert(_tree->left, d->key, d->value);
+                if (added) {
+                    _size++;
+                    _extend_extrema(_find(_tree->left, d->key));
+                }
+            }
+            delete d;
+        }
+    }
+
+    // requires the unique lock
+    bool _erase(const key_type& key) {
+        if (!_tree->left || !_find(_tree->left, key))
+            return false;
+        _tree->left = _remove(_tree->left, key);
+        _size--;
+        if (!(_leftmost->key < key))
+            _leftmost = _findmin(_tree->left);
+        if (!(key < _rightmost->key))
+            _rightmost = _findmax(_tree->left);
+        return true;
+    }
+
+    // takes the whole tree out, leaving this one empty
+    nodeptr _detach() {
+        unique_lock lock(_mutex);
+        _apply_deltas();
+        nodeptr root = std::move(_tree->left);
+        _reset_bounds();
+        return root;
+    }
+
+    // requires the unique lock; after the root was replaced wholesale
+    void _reset_bounds() {
+        _size = _count(_tree->left);
+        _leftmost = _findmin(_tree->left);
+        _rightmost = _findmax(_tree->left);
+        _epoch++;
+    }
+
+    // Joins l, m and r, where every key of l is less than m's and every key of
+    // r greater: m goes down the spine of the higher tree to where the heights
+    // meet, and the path back up is rebalanced. O(|height(l) - height(r)|).
+    nodeptr _join(nodeptr l, nodeptr m, nodeptr r) {
+        if (_height(l) > _height(r) + 1) {
+            l->right = _join(std::move(l->right), std::move(m), std::move(r));
+            return _balance(l);
+        }
+        if (_height(r) > _height(l) + 1) {
+            r->left = _join(std::move(l), std::move(m), std::move(r->left));
+            return _balance(r);
+        }
+        m->left = std::move(l);
+        m->right = std::move(r);
+        _fixheight(m);
+        return m;
+    }
+
+    // join without a middle node: r's minimum takes that role
+    nodeptr _join2(nodeptr l, nodeptr r) {
+        if (!l) return r;
+        if (!r) return l;
+        nodeptr m = _findmin(r);
+        r = _removemin(r);
+        return _join(std::move(l), std::move(m), std::move(r));
+    }
+
+    // Splits t into the keys less than `key` and the rest. With `match`, the
+    // node holding `key` itself is taken out into it instead.
+    void _split(nodeptr t, const key_type& key, nodeptr& l, nodeptr& r, nodeptr* match = nullptr) {
+        if (!t) {
+            l = nodeptr(nullptr);
+            r = nodeptr(nullptr);
+            return;
+        }
+        nodeptr tl = std::move(t->left);
+        nodeptr tr = std::move(t->right);
+        nodeptr a, b;
+        if (t->key < key) {
+            _split(std::move(tr), key, a, b, match);
+            l = _join(std::move(tl), std::move(t), std::move(a));
+            r = std::move(b);
+        } else if (match && !(key < t->key)) {
+            l = std::move(tl);
+            r = std::move(tr);
+            *match = std::move(t);
+        } else {
+            _split(std::move(tl), key, a, b, match);
+            l = std::move(a);
+            r = _join(std::move(b), std::move(t), std::move(tr));
+        }
+    }
+
+    // part of a parallel scan: a whole subtree, or just the node itself
+    struct scan_piece {
+        const node* n;
+        bool subtree;
+    };
+
+    // cuts the subtree at n into in-order pieces of at most `limit` elements
+    static void _partition(const node* n, size_t limit, std::vector<scan_piece>& pieces) {
+        if (!n) return;
+        if (n->count <= limit) {
+            pieces.push_back({n, true});
+            return;
+        }
+        _partition(n->left.get(), limit, pieces);
+        pieces.push_back({n, false});
+        _partition(n->right.get(), limit, pieces);
+    }
+
+    template<typename F>
+    static void _scan(const scan_piece& piece, F& fn) {
+        if (!piece.subtree) {
+            fn(piece.n->key, piece.n->value);
+            return;
+        }
+        std::vector<const node*> stack;
+        const node* n = piece.n;
+        while (n || !stack.empty()) {
+            for (; n; n = n->left.get())
+                stack.push_back(n);
+            n = stack.back();
+            stack.pop_back();
+            fn(n->key, n->value);
+            n = n->right.get();
+        }
+    }
+
+    // stable sort by key: `threads` runs sorted at once, then merged pairwise
+    static void _parallel_sort(std::vector<std::pair<Key, T>>& items, unsigned threads) {
+        auto less = [](const std::pair<Key, T>& a, const std::pair<Key, T>& b) {
+            return a.first < b.first;
+        };
+        size_t runs = std::max<size_t>(1, std::min<size_t>(threads, items.size() / _parallel_grain));
+        std::vector<size_t> bounds;
+        for (size_t i = 0; i <= runs; ++i)
+            bounds.push_back(items.size() * i / runs);
+
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < runs; ++i)
+            workers.emplace_back([&items, &bounds, less, i]() {
+                std::stable_sort(items.begin() + bounds[i], items.begin() + bounds[i + 1], less);
+            });
+        std::stable_sort(items.begin() + bounds[0], items.begin() + bounds[1], less);
+        for (auto& w : workers)
+            w.join();
+
+        for (size_t width = 1; width < runs; width *= 2) {
+            workers.clear();
+            for (size_t i = 0; i + width < runs; i += 2 * width) {
+                size_t lo = bounds[i], mid = bounds[i + width], hi = bounds[std::min(i + 2 * width, runs)];
+                workers.emplace_back([&items, less, lo, mid, hi]() {
+                    std::inplace_merge(items.begin() + lo, items.begin() + mid, items.begin() + hi, less);
+                });
+            }
+            for (auto& w : workers)
+                w.join();
+        }
+    }
+
+    // balanced tree over the sorted, unique items[lo, hi)
+    nodeptr _build(const std::vector<std::pair<Key, T>>& items, size_t lo, size_t hi, int depth) {
+        if (lo == hi)
+            return nodeptr(nullptr);
+        size_t mid = lo + (hi - lo) / 2;
+        nodeptr n = make_smart<node, Policy>(items[mid].first, items[mid].second);
+        bool fork = Policy::thread_safe && depth > 0 && hi - lo >= _parallel_grain;
+        if (fork) {
+            auto left = std::async(std::launch::async, [&]() { return _build(items, lo, mid, depth - 1); });
+            n->right = _build(items, mid + 1, hi, depth - 1);
+            n->left = left.get();
+        } else {
+            n->left = _build(items, lo, mid, depth);
+            n->right = _build(items, mid + 1, hi, depth);
+        }
+        _fixheight(n);
+        return n;
+    }
+
+    // subproblems smaller than this run on the calling thread
+    static constexpr size_t _parallel_grain = 4096;
+
+    // how many levels of the recursion may still fork, ~log2 of the cores
+    static int _parallel_depth() {
+        int depth = 0;
+        for (unsigned n = std::thread::hardware_concurrency(); n > 1; n >>= 1)
+            ++depth;
+        return depth + 1;
+    }
+
+    using set_operation = nodeptr (avl_tree::*)(nodeptr, nodeptr, int);
+
+    template<typename Op>
+    void _combine(avl_tree& other, Op op) {
+        unique_lock lock(_mutex, std::defer_lock);
+        unique_lock other_lock(other._mutex, std::defer_lock);
+        std::lock(lock, other_lock);
+        _apply_deltas();
+        other._apply_deltas();
+        nodeptr b = std::move(other._tree->left);
+        other._reset_bounds();
+        other_lock.unlock();
+
+        _tree->left = (this->*op)(std::move(_tree->left), std::move(b), _parallel_depth());
+        _reset_bounds();
+    }
+
+    // Splits a by b's root and runs `op` on the two halves, the left one on
+    // another thread when there is enough work left and forks to spend.
+    // Returns the results and a's node with b's root key, if any.
+    std::pair<nodeptr, nodeptr> _recurse(set_operation op, nodeptr& a, nodeptr& b, nodeptr& match, int depth) {
+        bool fork = Policy::thread_safe && depth > 0 && _count(a) + _count(b) >= _parallel_grain;
+        nodeptr al, ar;
+        _split(std::move(a), b->key, al, ar, &match);
+        nodeptr bl = std::move(b->left);
+        nodeptr br = std::move(b->right);
+        if (fork) {
+            auto left = std::async(std::launch::async, [&]() {
+                return (this->*op)(std::move(al), std::move(bl), depth - 1);
+            });
+            nodeptr right = (this->*op)(std::move(ar), std::move(br), depth - 1);
+            return {left.get(), std::move(right)};
+        }
+        nodeptr left = (this->*op)(std::move(al), std::move(bl), depth);
+        return {std::move(left), (this->*op)(std::move(ar), std::move(br), depth)};
+    }
+
+    nodeptr _union(nodeptr a, nodeptr b, int depth) {
+        if (!a) return b;
+        if (!b) return a;
+        nodeptr match;
+        auto [l, r] = _recurse(&avl_tree::_union, a, b, match, depth);
+        return _join(std::move(l), std::move(b), std::move(r));
+    }
+
+    nodeptr _intersection(nodeptr a, nodeptr b, int depth) {
+        if (!a || !b) return nodeptr(nullptr);
+        nodeptr match;
+        auto [l, r] = _recurse(&avl_tree::_intersection, a, b, match, depth);
+        if (match)
+            return _join(std::move(l), std::move(match), std::move(r));
+        return _join2(std::move(l), std::move(r));
+    }
+
+    nodeptr _difference(nodeptr a, nodeptr b, int depth) {
+        if (!a) return nodeptr(nullptr);
+        if (!b) return a;
+        nodeptr match;
+        auto [l, r] = _recurse(&avl_tree::_difference, a, b, match, depth);
+        return _join2(std::move(l), std::move(r));
+    }
+
+    // Publishes the request and waits for it to be applied. The waiter spins
+    // on its own slot, which stays in its cache until the combiner writes the
+    // result, and only now and then tries the lock to become the combiner
+    // itself (first of all right away, in case nobody holds it).
+    std::pair<nodeptr, bool> _publish(bool erase, const key_type& key, const value_type& val) {
+        combining_slot& slot = _claim_slot();
+        slot.erase = erase;
+        slot.key = key;
+        slot.value = val;
+        slot.state.store(combining_slot::pending, std::memory_order_release);
+        for (size_t spins = 0; slot.state.load(std::memory_order_acquire) != combining_slot::done; ++spins) {
+            if (spins % _combining_spins != 0)
+                continue;
+            unique_lock lock(_mutex, std::try_to_lock);
+            if (lock.owns_lock()) {
+                _apply_deltas();
+                _run_combiner();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        std::pair<nodeptr, bool> res(std::move(slot.node), slot.changed);
+        slot.state.store(combining_slot::free, std::memory_order_relaxed);
+        slot.owned.store(false, std::memory_order_release);
+        return res;
+    }
+
+    // a free slot, starting from the one this thread was handed on its first
+    // request; the first 64 threads all get a slot of their own
+    combining_slot& _claim_slot() {
+        static std::atomic<size_t> next_index{0};
+        thread_local size_t start = next_index.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; ; ++i) {
+            combining_slot& slot = _slots[(start + i) % _combining_slots];
+            bool expected = false;
+            if (!slot.owned.load(std::memory_order_relaxed) &&
+                slot.owned.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return slot;
+            if (i % _combining_slots == _combining_slots - 1)
+                std::this_thread::yield();
+        }
+    }
+
+    // requires the unique lock
+    void _run_combiner() {
+        combining_slot* batch[_combining_slots];
+        size_t count = 0;
+        for (size_t i = 0; i < _combining_slots; ++i)
+            if (_slots[i].state.load(std::memory_order_acquire) == combining_slot::pending)
+                batch[count++] = &_slots[i];
+        std::sort(batch, batch + count, [](const combining_slot* a, const combining_slot* b) {
+            return a->key < b->key;
+        });
+        for (size_t i = 0; i < count; ++i) {
+            combining_slot* slot = batch[i];
+            if (slot->erase) {
+                slot->changed = _erase(slot->key);
+            } else {
+                auto res = _emplace(slot->key, [slot]() -> const T& { return slot->value; });
+                slot->node = std::move(res.first);
+                slot->changed = res.second;
+            }
+            slot->state.store(combining_slot::done, std::memory_order_release);
+        }
+    }
+
+    // requires the unique lock; inserts make() unless the key is present,
+    // returns the key's node and whether it was inserted
+    template<typename F>
+    std::pair<nodeptr, bool> _emplace(const key_type& key, F&& make) {
+        std::pair<nodeptr, bool> res(nodeptr(nullptr), false);
+        _tree->left = _emplace(std::move(_tree->left), key, make, res);
+        if (res.second) {
+            _size++;
+            _extend_extrema(res.first);
+        }
+        return res;
+    }
+
+    template<typename F>
+    nodeptr _emplace(nodeptr n, const key_type& key, F& make, std::pair<nodeptr, bool>& res) {
+        if (!n) {
+            n = make_smart<node, Policy>(key, make());
+            res = {n, true};
+            return n;
+        }
+        if (key < n->key) {
+            n->left = _emplace(std::move(n->left), key, make, res);
+        } else if (n->key < key) {
+            n->right = _emplace(std::move(n->right), key, make, res);
+        } else {
+            res.first = n;
+            return n;
+        }
+        return res.second ? _balance(n) : n;
+    }
+
+    // requires the unique lock
+    void _extend_extrema(const nodeptr& n) {
+        if (!_leftmost || n->key < _leftmost->key)
+            _leftmost = n;
+        if (!_rightmost || _rightmost->key < n->key)
+            _rightmost = n;
+    }
+
+    // requires the unique lock
+    std::optional<std::pair<Key, T>> _pop(const nodeptr& extreme) {
+        if (!extreme)
+            return std::nullopt;
+        std::pair<Key, T> res(extreme->key, extreme->value);
+        _erase(res.first);
+        return res;
+    }
+
+    static void _prefetch(const nodeptr& n) {
+#if defined(__GNUC__) || defined(__clang__)
+        // n.get() would already load the line the prefetch is meant to fetch
+        __builtin_prefetch(n.block());
+#endif
+    }
+
     int _height(nodeptr n) {
         return n ? n->height : 0;
     }
@@ -247,9 +1304,15 @@ private:
         return _height(n->right) - _height(n->left);
     }
 
+    static size_t _count(const nodeptr& n) {
+        return n ? n->count : 0;
+    }
+
+    // also recounts the subtree
     void _fixheight(nodeptr n) {
         n->height = (_height(n->left) > _height(n->right) ?
                      _height(n->left) : _height(n->right))+1;
+        n->count = _count(n->left) + _count(n->right) + 1;
     }
     
     nodeptr _RRotation(nodeptr n) {
@@ -269,7 +1332,7 @@ private:
     }
 
     nodeptr _insert(nodeptr n, Key k, T val) {
-        if(!n) n = nodeptr(new node(k, val));
+        if(!n) n = make_smart<node, Policy>(k, val);
         if(k < n->key)
             n->left = _insert(n->left, k, val);
         else if(k > n->key)
@@ -299,27 +1362,83 @@ private:
         return n;
     }
 
-    nodeptr _find(nodeptr n, const key_type& key) {
-        if(n->left && n->key > key)
-            return _find(n->left, key);
-        else if(n->right && n->key < key)
-            return _find(n->right, key);
-        else {
-            if(n->key != key) return nodeptr(nullptr);
-            return n;
+    // Returns the link holding the first node whose key is not less than `key`,
+    // or nullptr. One comparison per level and no early exit, so the child
+    // selection compiles to a conditional move instead of a mispredicted branch;
+    // links are followed in place, so no SmartPointer is copied on the way down.
+    const nodeptr* _lower_bound(const nodeptr& root, const key_type& key) const {
+        const nodeptr* n = &root;
+        const nodeptr* candidate = nullptr;
+        while (*n) {
+            node* p = n->get();
+            bool go_right = p->key < key;
+            candidate = go_right ? candidate : n;
+            n = go_right ? &p->right : &p->left;
+        }
+        return candidate;
+    }
+
+    nodeptr _find(const nodeptr& root, const key_type& key) const {
+        const nodeptr* n = _lower_bound(root, key);
+        if(!n || key < (*n)->key) return nodeptr(nullptr);
+        return *n;
+    }
+
+    // first node with a key greater than `key`
+    nodeptr _successor(const key_type& key) const {
+        const nodeptr* n = &_tree->left;
+        const nodeptr* candidate = nullptr;
+        while (*n) {
+            node* p = n->get();
+            bool go_right = !(key < p->key);
+            candidate = go_right ? candidate : n;
+            n = go_right ? &p->right : &p->left;
+        }
+        return candidate ? *candidate : nodeptr(nullptr);
+    }
+
+    // last node with a key less than `key`
+    nodeptr _predecessor(const key_type& key) const {
+        const nodeptr* n = &_tree->left;
+        const nodeptr* candidate = nullptr;
+        while (*n) {
+            node* p = n->get();
+            bool go_right = p->key < key;
+            candidate = go_right ? n : candidate;
+            n = go_right ? &p->right : &p->left;
+        }
+        return candidate ? *candidate : nodeptr(nullptr);
+    }
+
+    // Frees a detached subtree with an explicit stack instead of recursing
+    // once per level through the SmartPointer destructors. Nodes an iterator
+    // still holds survive, without their children.
+    static void _dispose(nodeptr root) {
+        std::vector<nodeptr> stack;
+        if (root)
+            stack.push_back(std::move(root));
+        while (!stack.empty()) {
+            nodeptr n = std::move(stack.back());
+            stack.pop_back();
+            if (n->left)
+                stack.push_back(std::move(n->left));
+            if (n->right)
+                stack.push_back(std::move(n->right));
         }
     }
 
-    nodeptr _findmin(nodeptr n) {   
-        if(n)
-            return n->left ? _findmin(n->left) : n;
-        return nodeptr(nullptr);
+    nodeptr _findmin(const nodeptr& root) const {
+        const nodeptr* n = &root;
+        while (*n && (*n)->left)
+            n = &(*n)->left;
+        return *n;
     }
 
-    nodeptr _findmax(nodeptr n) {
-        if(n)
-            return n->right ? _findmax(n->right) : n;
-        return nodeptr(nullptr);
+    nodeptr _findmax(const nodeptr& root) const {
+        const nodeptr* n = &root;
+        while (*n && (*n)->right)
+            n = &(*n)->right;
+        return *n;
     }
 
     nodeptr _removemin(nodeptr n) {
@@ -337,8 +1456,10 @@ private:
             n->right = _remove(n->right,k);
         else
         {
-            nodeptr tmpl = n->left;
-            nodeptr tmpr = n->right;
+            // the erased node may outlive this call in an iterator, so it
+            // must not keep its old subtree alive
+            nodeptr tmpl = std::move(n->left);
+            nodeptr tmpr = std::move(n->right);
 
             n->deleted = true;
 
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * Immutable ordered map for tables that are built once and then only read,
+ * usually by avl_tree::freeze(). Keys are stored in Eytzinger (BFS) order in
+ * one array and values in the same order in another, so a search touches one
+ * contiguous array, its first levels share a few cache lines, and lower_bound
+ * runs without branches on the comparison. Nothing is locked: any number of
+ * threads may read it at once.
+ * \param Key The key type. The type (class) must provide a 'less than' operator
+ * \param T The Data type
+ */
+template<typename Key, typename T>
+class frozen_tree
+{
+    // 1-based: the children of slot k are 2k and 2k + 1, slot 0 is unused
+    std::vector<Key> _keys;
+    std::vector<T> _values;
+
+    // iterator class
+    typedef class tag_frozen_tree_iterator
+    {
+        const frozen_tree* _tree;
+        // Eytzinger slot, 0 is end()
+        size_t _k;
+
+    public:
+        tag_frozen_tree_iterator(const frozen_tree& tree, size_t k)
+                : _tree(&tree), _k(k)
+        { }
+
+        bool operator==(const tag_frozen_tree_iterator& rhs) const {
+            return _k == rhs._k;
+        }
+
+        bool operator!=(const tag_frozen_tree_iterator& rhs) const {
+            return _k != rhs._k;
+        }
+
+        const T& operator*() const {
+            return _tree->_values[_k];
+        }
+
+        const T& val() const {
+            return _tree->_values[_k];
+        }
+
+        const Key& key() const {
+            return _tree->_keys[_k];
+        }
+
+        // preincrement
+        tag_frozen_tree_iterator& operator++() {
+            size_t n = _tree->size();
+            if (_k == 0) return *this;
+            if (2 * _k + 1 <= n) {
+                _k = 2 * _k + 1;
+                while (2 * _k <= n)
+                    _k = 2 * _k;
+            } else {
+                // up while we are a right child, then once more
+                while (_k & 1)
+                    _k >>= 1;
+                _k >>= 1;
+            }
+            return *this;
+        }
+
+        // postincrement
+        const tag_frozen_tree_iterator operator++(int) {
+            tag_frozen_tree_iterator _copy = *this;
+            ++(*this);
+            return _copy;
+        }
+
+        // predecrement, end() steps to the last element
+        tag_frozen_tree_iterator& operator--() {
+            size_t n = _tree->size();
+            if (_k == 0) {
+                _k = n == 0 ? 0 : _tree->_last();
+            } else if (2 * _k <= n) {
+                _k = 2 * _k;
+                while (2 * _k + 1 <= n)
+                    _k = 2 * _k + 1;
+            } else {
+                while (_k > 1 && !(_k & 1))
+                    _k >>= 1;
+                _k >>= 1;
+            }
+            return *this;
+        }
+
+        const tag_frozen_tree_iterator operator--(int) {
+            tag_frozen_tree_iterator _copy = *this;
+            --(*this);
+            return _copy;
+        }
+    } frozen_tree_iterator;
+
+    friend tag_frozen_tree_iterator;
+public:
+
+    typedef T                       value_type;
+    typedef Key                     key_type;
+    typedef frozen_tree_iterator    iterator;
+    typedef size_t                  size_type;
+
+    frozen_tree() : _keys(1), _values(1) {}
+
+    // `keys` must be sorted and unique, values[i] belongs to keys[i]
+    frozen_tree(const std::vector<Key>& keys, const std::vector<T>& values)
+            : _keys(keys.size() + 1), _values(values.size() + 1) {
+        size_t i = 0;
+        _place(keys, values, i, 1);
+    }
+
+    iterator begin() const {
+        size_t k = 1;
+        while (2 * k <= size())
+            k = 2 * k;
+        return iterator(*this, empty() ? 0 : k);
+    }
+
+    iterator end() const {
+        return iterator(*this, 0);
+    }
+
+    size_type size() const {
+        return _keys.size() - 1;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // first element whose key is not less than `key`
+    iterator lower_bound(const key_type& key) const {
+        const Key* keys = _keys.data();
+        size_t n = size();
+        size_t k = 1;
+        while (k <= n)
+            k = 2 * k + (keys[k] < key);
+        // undo the right turns taken after the last left one
+        return iterator(*this, _drop_right_turns(k));
+    }
+
+    iterator find(const key_type& key) const {
+        iterator it = lower_bound(key);
+        if (it == end() || key < it.key())
+            return end();
+        return it;
+    }
+
+    // Helper functions
+private:
+    // in-order walk over the slots, handing out the sorted input in turn
+    void _place(const std::vector<Key>& keys, const std::vector<T>& values, size_t& i, size_t k) {
+        if (k > size())
+            return;
+        _place(keys, values, i, 2 * k);
+        _keys[k] = keys[i];
+        _values[k] = values[i];
+        ++i;
+        _place(keys, values, i, 2 * k + 1);
+    }
+
+    // shifts out the trailing ones of k and the zero above them
+    static size_t _drop_right_turns(size_t k) {
+#if defined(__GNUC__) || defined(__clang__)
+        return k >> __builtin_ffsll(~static_cast<unsigned long long>(k));
+#else
+        while (k & 1)
+            k >>= 1;
+        return k >> 1;
+#endif
+    }
+
+    size_t _last() const {
+        size_t k = 1;
+        while (2 * k + 1 <= size())
+            k = 2 * k + 1;
+        return k;
+    }
+};
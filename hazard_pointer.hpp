@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace hazard_pointer {
+
+    class guard;
+
+    // Hazard-pointer reclamation domain.
+    // A thread that is about to dereference a shared node publishes its address
+    // in a slot (see `guard`); nodes nobody links to any more are handed to
+    // retire() instead of being freed. Once `retire_threshold` nodes are
+    // waiting, one scan frees every retired node whose address is in no slot,
+    // so at most threshold + slots nodes are ever pending.
+    // A domain must outlive every guard and retired node that uses it.
+    class domain {
+        friend guard;
+
+        struct record {
+            std::atomic<const void*> hazard{nullptr};
+            std::atomic<bool> active{false};
+            record* next = nullptr;
+        };
+
+        struct retired {
+            void* ptr;
+            void (*reclaim)(void*);
+            retired* next;
+        };
+
+        std::atomic<record*> _records{nullptr};
+        std::atomic<retired*> _retired{nullptr};
+        std::atomic<size_t> _retired_count{0};
+        std::atomic<bool> _scanning{false};
+        size_t _threshold;
+
+        // slots are reused by whichever thread grabs them next, so there are only
+        // ever as many of them as threads guarding at the same time
+        record* acquire() {
+            for (record* r = _records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+                bool expected = false;
+                if (!r->active.load(std::memory_order_relaxed) && r->active.compare_exchange_strong(expected, true))
+                    return r;
+            }
+            record* r = new record();
+            r->active = true;
+            r->next = _records.load(std::memory_order_relaxed);
+            while (!_records.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                                   std::memory_order_relaxed));
+            return r;
+        }
+
+        static void release(record* r) {
+            r->hazard.store(nullptr, std::memory_order_release);
+            r->active.store(false, std::memory_order_release);
+        }
+
+        void push(retired* r) {
+            r->next = _retired.load(std::memory_order_relaxed);
+            while (!_retired.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                                   std::memory_order_relaxed));
+        }
+
+    public:
+        explicit domain(size_t retire_threshold = 64) : _threshold(retire_threshold) {}
+
+        domain(const domain&) = delete;
+        domain& operator=(const domain&) = delete;
+
+        ~domain() {
+            // reclaiming a node may retire its neighbours, keep going until quiet
+            while (scan() != 0) {}
+            for (retired* r = _retired.exchange(nullptr); r != nullptr; ) {
+                retired* next = r->next;
+                r->reclaim(r->ptr);
+                delete r;
+                r = next;
+            }
+            for (record* r = _records.exchange(nullptr); r != nullptr; ) {
+                record* next = r->next;
+                delete r;
+                r = next;
+            }
+        }
+
+        // `reclaim(ptr)` runs once no guard protects ptr
+        void retire(void* ptr, void (*reclaim)(void*)) {
+            push(new retired{ptr, reclaim, nullptr});
+            if (_retired_count.fetch_add(1) + 1 >= _threshold)
+                scan();
+        }
+
+        template<typename T>
+        void retire(T* ptr) {
+            retire(ptr, [](void* p) { delete static_cast<T*>(p); });
+        }
+
+        // Reclaims every retired node that no guard protects and returns how
+        // many were reclaimed. Only one thread scans at a time; a concurrent
+        // call returns 0 straight away.
+        size_t scan() {
+            bool expected = false;
+            if (!_scanning.compare_exchange_strong(expected, true))
+                return 0;
+
+            retired* pending = _retired.exchange(nullptr, std::memory_order_acquire);
+            std::vector<const void*> hazards;
+            for (record* r = _records.load(std::memory_order_acquire); r != nullptr; r = r->next)
+                if (const void* h = r->hazard.load())
+                    hazards.push_back(h);
+            std::sort(hazards.begin(), hazards.end());
+
+            size_t reclaimed = 0;
+            while (pending != nullptr) {
+                retired* r = pending;
+                pending = r->next;
+                if (std::binary_search(hazards.begin(), hazards.end(), static_cast<const void*>(r->ptr))) {
+                    push(r);
+                } else {
+                    _retired_count--;
+                    r->reclaim(r->ptr);
+                    delete r;
+                    ++reclaimed;
+                }
+            }
+
+            _scanning.store(false, std::memory_order_release);
+            return reclaimed;
+        }
+
+        size_t retire_threshold() const {
+            return _threshold;
+        }
+    };
+
+    // Owns one hazard slot of a domain for its lifetime. A node is safe to
+    // dereference once it is published with set() and then re-read from the
+    // link it came from, or when obtained through protect().
+    class guard {
+        domain::record* _record;
+
+    public:
+        explicit guard(domain& d) : _record(d.acquire()) {}
+
+        guard(const guard&) = delete;
+        guard& operator=(const guard&) = delete;
+
+        ~guard() {
+            domain::release(_record);
+        }
+
+        void set(const void* ptr) {
+            _record->hazard.store(ptr);
+        }
+
+        void reset() {
+            set(nullptr);
+        }
+
+        template<typename T>
+        T* protect(const std::atomic<T*>& src) {
+            T* ptr = src.load(std::memory_order_relaxed);
+            while (true) {
+                set(ptr);
+                T* again = src.load(std::memory_order_acquire);
+                if (again == ptr)
+                    return ptr;
+                ptr = again;
+            }
+        }
+    };
+}  // namespace hazard_pointer
@@ -1,6 +1,15 @@
 #include "consistent_tree.hpp"
+#include "concurrent_skiplist.hpp"
+#include "static_avl_tree.hpp"
+#include "hazard_pointer.hpp"
+#include "4 - fine grained list/list.hpp"
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
 #include <string>
 #include <thread>
 #include <vector>
@@ -9,6 +18,15 @@ using std::string;
 using std::thread;
 using std::vector;
 
+// counts its live instances, for tests that check what a container frees
+struct counted {
+    static std::atomic<int>& alive() { static std::atomic<int> n(0); return n; }
+    counted() { alive()++; }
+    counted(const counted&) { alive()++; }
+    counted& operator=(const counted&) = default;
+    ~counted() { alive()--; }
+};
+
 TEST_CASE("basic avl tests") {
     avl_tree<char, string> tree;
     tree.insert('0', "abc");
@@ -147,4 +165,972 @@ TEST_CASE("Coarse-grained in(de)crement") {
     for (auto& t : threads)
         t.join();
     REQUIRE(it == ++tree.begin());
-}
\ No newline at end of file
+}
+
+TEST_CASE("find hits and misses") {
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 1000; i += 2) tree.insert(i, i * 10);
+
+    for (int i = 0; i < 1000; ++i) {
+        auto it = tree.find(i);
+        if (i % 2 == 0) {
+            REQUIRE(it != tree.end());
+            REQUIRE(it.key() == i);
+            REQUIRE(it.val() == i * 10);
+        } else {
+            REQUIRE(it == tree.end());
+        }
+    }
+    REQUIRE(tree.find(-1) == tree.end());
+    REQUIRE(tree.find(1000) == tree.end());
+}
+
+TEST_CASE("find_batch") {
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 300; i += 3) tree.insert(i, -i);
+
+    vector<int> keys;
+    for (int i = 0; i < 100; ++i) keys.push_back(std::rand() % 320 - 10);
+
+    auto res = tree.find_batch(keys);
+    REQUIRE(res.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        REQUIRE(res[i] == tree.find(keys[i]));
+        if (res[i] != tree.end())
+            REQUIRE(res[i].val() == -keys[i]);
+    }
+    avl_tree<int, int> empty;
+    REQUIRE(empty.find_batch(keys).size() == keys.size());
+}
+
+TEST_CASE("guarded reads") {
+    avl_tree<int, string> tree;
+    tree.insert(1, "one");
+    tree.insert(2, "two");
+
+    auto it = tree.find(2);
+    REQUIRE(it.load() == "two");
+    {
+        auto g = it.guard();
+        REQUIRE(*g == "two");
+        REQUIRE(g->size() == 3);
+        REQUIRE(g.key() == 2);
+    }
+
+    std::atomic<int> mismatches = 0;
+    vector<thread> readers;
+    for (int i = 0; i < 4; ++i)
+        readers.emplace_back([&tree, &mismatches]() {
+            for (int j = 0; j < 100; ++j)
+                if (tree.find(1).load() != "one") mismatches++;
+        });
+    for (int j = 0; j < 100; ++j) {
+        tree.insert(j + 10, "x");
+        tree.erase(j + 10);
+    }
+    for (auto& t : readers)
+        t.join();
+    REQUIRE(mismatches == 0);
+
+    tree.erase(2);
+    REQUIRE(it.load() == "two");
+}
+
+TEST_CASE("skiplist basic") {
+    concurrent_skiplist<int, int> list;
+    for (int i = 0; i < 200; ++i) list.insert((i * 37) % 200, i);
+    REQUIRE(list.size() == 200);
+
+    int expected = 0;
+    for (auto it = list.begin(); it != list.end(); ++it)
+        REQUIRE(it.key() == expected++);
+    REQUIRE(expected == 200);
+
+    REQUIRE(list.find(5) != list.end());
+    REQUIRE(list.erase(5));
+    REQUIRE(!list.erase(5));
+    REQUIRE(list.find(5) == list.end());
+    REQUIRE(list.size() == 199);
+}
+
+TEST_CASE("skiplist consistency") {
+    concurrent_skiplist<int, int> list;
+    list.insert(1, 2);
+    list.insert(3, 4);
+    list.insert(5, 6);
+
+    auto it = list.begin();
+    ++it;
+    REQUIRE(it.key() == 3);
+
+    list.erase(3);
+    list.erase(5);
+    list.insert(4, 8);
+    REQUIRE(it.val() == 4);
+
+    ++it;
+    REQUIRE(it.key() == 4);
+    REQUIRE(it.val() == 8);
+    ++it;
+    REQUIRE(it == list.end());
+}
+
+TEST_CASE("skiplist concurrent") {
+    int n = 8;
+    concurrent_skiplist<int, int> list;
+    vector<thread> threads;
+
+    for (int t = 0; t < n; ++t)
+        threads.emplace_back([&list, t]() {
+            for (int i = 0; i < 500; ++i) {
+                list.insert(i * 8 + t, i);
+                if (i % 2)
+                    list.erase((i - 1) * 8 + t);
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+
+    size_t count = 0;
+    int prev = -1;
+    for (auto it = list.begin(); it != list.end(); ++it, ++count) {
+        REQUIRE(prev < it.key());
+        prev = it.key();
+    }
+    REQUIRE(count == list.size());
+    REQUIRE(count == 250 * 8);
+
+    // find never returns a neighbour that is being inserted and erased
+    concurrent_skiplist<int, int> sparse;
+    sparse.insert(0, 0);
+    sparse.insert(10, 10);
+    std::atomic<bool> done(false);
+    std::atomic<int> wrong(0);
+    thread writer([&]() {
+        for (int i = 0; i < 20000; ++i) {
+            sparse.insert(3, 3);
+            sparse.erase(3);
+        }
+        done = true;
+    });
+    vector<thread> readers;
+    for (int t = 0; t < 3; ++t)
+        readers.emplace_back([&]() {
+            while (!done) {
+                auto it = sparse.find(5);
+                if (it != sparse.end()) wrong++;
+                it = sparse.find(10);
+                if (it == sparse.end() || it.key() != 10) wrong++;
+            }
+        });
+    writer.join();
+    for (auto& r : readers)
+        r.join();
+    REQUIRE(wrong == 0);
+}
+
+TEST_CASE("delta updates") {
+    avl_tree<int, int> tree;
+    tree.insert(1, 1);
+    tree.post_insert(2, 2);
+    tree.post_insert(1, 10);
+    tree.post_erase(2);
+    tree.post_insert(3, 3);
+
+    REQUIRE(tree.find(1).val() == 10);
+    REQUIRE(tree.find(2) == tree.end());
+    REQUIRE(tree.find(3).val() == 3);
+    REQUIRE(tree.size() == 2);
+
+    tree.start_consolidator(std::chrono::milliseconds(1));
+    vector<thread> writers;
+    for (int t = 0; t < 4; ++t)
+        writers.emplace_back([&tree, t]() {
+            for (int i = 0; i < 250; ++i)
+                tree.post_insert(100 + i * 4 + t, i);
+        });
+    for (auto& w : writers)
+        w.join();
+    tree.stop_consolidator();
+    tree.consolidate();
+    REQUIRE(tree.size() == 1002);
+    REQUIRE(tree.find(1099).val() == 249);
+}
+
+TEST_CASE("make_smart") {
+    struct tracked {
+        int& alive;
+        int value;
+        tracked(int& alive, int value) : alive(alive), value(value) { alive++; }
+        ~tracked() { alive--; }
+    };
+
+    int alive = 0;
+    {
+        auto p = smart_pointer::make_smart<tracked>(alive, 7);
+        REQUIRE(alive == 1);
+        REQUIRE(p->value == 7);
+        REQUIRE(p.count_owners() == 1);
+
+        auto q = p;
+        REQUIRE(q.count_owners() == 2);
+        REQUIRE(q == p);
+        p = smart_pointer::SmartPointer<tracked>();
+        REQUIRE(alive == 1);
+        REQUIRE(q.count_owners() == 1);
+    }
+    REQUIRE(alive == 0);
+
+    struct throwing {
+        throwing() { throw 1; }
+    };
+    REQUIRE_THROWS(smart_pointer::make_smart<throwing>());
+}
+
+TEST_CASE("atomic_smart_pointer") {
+    using smart_pointer::SmartPointer;
+    using smart_pointer::atomic_smart_pointer;
+    using smart_pointer::make_smart;
+
+    auto first = make_smart<int>(1);
+    atomic_smart_pointer<int> slot(first);
+    REQUIRE(*slot.load() == 1);
+    REQUIRE(first.count_owners() > 1);
+
+    auto second = make_smart<int>(2);
+    auto expected = make_smart<int>(3);
+    REQUIRE(!slot.compare_exchange_strong(expected, second));
+    REQUIRE(expected == first);
+    REQUIRE(slot.compare_exchange_strong(expected, second));
+    REQUIRE(first.count_owners() == 2);  // `first` and `expected`
+    expected = SmartPointer<int>();
+    REQUIRE(first.count_owners() == 1);
+
+    // a marked value stays readable but can no longer be swapped out
+    expected = second;
+    REQUIRE(!slot.try_mark(first));
+    REQUIRE(slot.try_mark(second));
+    REQUIRE(!slot.try_mark(second));
+    bool marked = false;
+    REQUIRE(slot.load(marked) == second);
+    REQUIRE(marked);
+    REQUIRE(!slot.compare_exchange_strong(expected, first));
+    REQUIRE(expected == second);
+    expected = SmartPointer<int>();
+
+    REQUIRE(*slot.exchange(SmartPointer<int>()) == 2);
+    REQUIRE(!slot.is_marked());
+    REQUIRE(!slot.load());
+    REQUIRE(second.count_owners() == 1);
+
+    // enough loads to top the reservation up several times
+    auto held = make_smart<int>(5);
+    slot.store(held);
+    for (int i = 0; i < 100000; ++i)
+        REQUIRE(*slot.load() == 5);
+    slot.store(SmartPointer<int>());
+    REQUIRE(held.count_owners() == 1);
+
+    // readers racing with writers: every loaded value is one that was stored
+    slot.store(make_smart<int>(0));
+    std::atomic<int> bad = 0;
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&slot, &bad, t]() {
+            for (int i = 0; i < 20000; ++i) {
+                if (t % 2) {
+                    slot.store(make_smart<int>(i));
+                } else {
+                    auto p = slot.load();
+                    if (!p || *p < 0 || *p >= 20000) bad++;
+                }
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+    REQUIRE(bad == 0);
+}
+
+TEST_CASE("single_threaded policy") {
+    using smart_pointer::single_threaded;
+
+    auto p = smart_pointer::make_smart<int, single_threaded>(4);
+    auto q = p;
+    REQUIRE(q.count_owners() == 2);
+    REQUIRE(*q == 4);
+
+    avl_tree<int, string, single_threaded> tree;
+    for (int i = 0; i < 100; ++i) tree.insert(i, std::to_string(i));
+    tree.erase(50);
+    REQUIRE(tree.size() == 99);
+    REQUIRE(tree.find(50) == tree.end());
+    REQUIRE(tree.find(51).load() == "51");
+
+    int expected = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it, ++expected) {
+        if (expected == 50) ++expected;
+        REQUIRE(it.key() == expected);
+    }
+    REQUIRE(expected == 100);
+}
+
+TEST_CASE("WeakPointer") {
+    using smart_pointer::WeakPointer;
+
+    auto p = smart_pointer::make_smart<string>("abc");
+    WeakPointer<string> w(p);
+    REQUIRE(!w.expired());
+    REQUIRE(*w.lock() == "abc");
+    REQUIRE(p.count_owners() == 1);
+
+    WeakPointer<string> copy = w;
+    p = smart_pointer::SmartPointer<string>();
+    REQUIRE(w.expired());
+    REQUIRE(!copy.lock());
+    REQUIRE(w == copy);
+}
+
+TEST_CASE("iterators pin only their own node") {
+    {
+        avl_tree<int, counted> tree;
+        for (int i = 0; i < 100; ++i) tree.insert(i, counted());
+        int before = counted::alive();
+
+        vector<avl_tree<int, counted>::iterator> its;
+        for (int i = 0; i < 100; i += 10) its.push_back(tree.find(i));
+        for (int i = 0; i < 100; ++i)
+            if (i % 10) tree.erase(i);
+        for (int i = 0; i < 100; i += 10) tree.erase(i);
+
+        // the erased nodes no longer hold their old subtrees, so only the
+        // ten nodes the iterators point at are left
+        REQUIRE(tree.empty());
+        REQUIRE(counted::alive() == before - 90);
+        for (auto& it : its) {
+            counted& c = *it;
+            (void)c;
+            ++it;
+            REQUIRE(it == tree.end());
+        }
+        REQUIRE(counted::alive() == before - 100);
+    }
+    REQUIRE(counted::alive() == 0);
+
+    avl_tree<int, string> tree;
+    tree.insert(1, string(100, 'x'));
+    auto it = tree.find(1);
+    string& r = *it;
+    tree.erase(1);
+    REQUIRE(r[50] == 'x');
+    REQUIRE(it.key() == 1);
+
+    tree.insert(0, "zero");
+    tree.insert(3, "three");
+    REQUIRE(!tree.erase(tree.find(7)));
+    REQUIRE(tree.size() == 2);
+    REQUIRE(tree.erase(tree.begin()));
+    REQUIRE(tree.size() == 1);
+    REQUIRE(tree.begin().key() == 3);
+}
+
+TEST_CASE("deferred destruction") {
+    auto& reclaimer = smart_pointer::deferred_reclaimer::instance();
+    while (reclaimer.collect() != 0) {}
+
+    avl_tree<int, counted, smart_pointer::deferred<>> tree;
+    for (int i = 0; i < 1000; ++i) tree.insert(i, counted());
+    REQUIRE(counted::alive() == 1001);  // with the head node
+
+    tree.clear();
+    REQUIRE(tree.empty());
+    REQUIRE(counted::alive() == 1001);
+    REQUIRE(reclaimer.pending() > 0);
+
+    REQUIRE(reclaimer.collect(10) == 10);
+    REQUIRE(counted::alive() == 991);
+
+    reclaimer.start(std::chrono::milliseconds(1));
+    while (counted::alive() != 1)
+        std::this_thread::yield();
+    reclaimer.stop();
+    REQUIRE(reclaimer.pending() == 0);
+}
+
+TEST_CASE("clear detaches the tree") {
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 100000; ++i) tree.insert(i, i);
+    auto it = tree.find(500);
+
+    std::atomic<bool> done(false);
+    std::atomic<int> failures(0);
+    thread reader([&]() {
+        while (!done) {
+            auto f = tree.find(700);
+            if (f != tree.end() && f.key() != 700) failures++;
+        }
+    });
+    tree.clear();
+    done = true;
+    reader.join();
+
+    REQUIRE(failures == 0);
+    REQUIRE(tree.empty());
+    REQUIRE(tree.begin() == tree.end());
+    REQUIRE((++it) == tree.end());
+
+    tree.insert(1, 1);
+    tree.insert(3, 3);
+    auto stale = tree.find(1);
+    tree.clear();
+    tree.insert(2, 2);
+    REQUIRE((++stale).key() == 2);
+}
+
+TEST_CASE("SmartPointer observers") {
+    smart_pointer::SmartPointer<int> p(new int(5));
+    smart_pointer::SmartPointer<int> empty;
+    REQUIRE(p == p);
+    REQUIRE(empty == empty);
+    REQUIRE(p != empty);
+    REQUIRE(bool(p));
+    REQUIRE(!empty);
+    REQUIRE(*p == 5);
+    REQUIRE(p.operator->() == p.get());
+    REQUIRE(empty.operator->() == nullptr);
+
+    // the control block address, which holds make_smart's object as well
+    auto inplace = smart_pointer::make_smart<int>(6);
+    auto offset = reinterpret_cast<const char*>(inplace.get()) - static_cast<const char*>(inplace.block());
+    REQUIRE(offset > 0);
+    REQUIRE(offset < 64);
+    REQUIRE(p.block() != nullptr);
+    REQUIRE(empty.block() == nullptr);
+}
+
+TEST_CASE("pooled policy") {
+    using policy = smart_pointer::pooled<>;
+    int* first = smart_pointer::make_smart<int, policy>(1).get();
+    auto second = smart_pointer::make_smart<int, policy>(2);
+    REQUIRE(second.get() == first);  // the freed block is reused
+
+    smart_pointer::SmartPointer<int, policy> raw(new int(3));
+    smart_pointer::WeakPointer<int, policy> weak(raw);
+    raw = smart_pointer::SmartPointer<int, policy>();
+    REQUIRE(weak.expired());
+
+    avl_tree<int, int, smart_pointer::deferred<policy>> tree;
+    for (int i = 0; i < 1000; ++i) tree.insert(i, i);
+    for (int i = 0; i < 1000; i += 2) tree.erase(i);
+    while (smart_pointer::deferred_reclaimer::instance().collect() != 0) {}
+    REQUIRE(tree.size() == 500);
+    int expected = 1;
+    for (auto it = tree.begin(); it != tree.end(); ++it, expected += 2)
+        REQUIRE(it.key() == expected);
+
+    // blocks freed on another thread come back through the shared depot
+    using small = smart_pointer::pooled<smart_pointer::multi_threaded, 8>;
+    vector<smart_pointer::SmartPointer<int, small>> ptrs;
+    std::set<int*> blocks;
+    for (int i = 0; i < 64; ++i) {
+        ptrs.push_back(smart_pointer::make_smart<int, small>(i));
+        blocks.insert(ptrs.back().get());
+    }
+    thread([&ptrs]() { ptrs.clear(); }).join();
+    int reused = 0;
+    for (int i = 0; i < 64; ++i) {
+        ptrs.push_back(smart_pointer::make_smart<int, small>(i));
+        reused += blocks.count(ptrs.back().get());
+    }
+    REQUIRE(reused == 64);
+}
+
+TEST_CASE("compact SmartPointer") {
+    REQUIRE(sizeof(smart_pointer::SmartPointer<int>) == sizeof(void*));
+    REQUIRE(sizeof(smart_pointer::WeakPointer<int>) == sizeof(void*));
+    REQUIRE(sizeof(smart_pointer::SmartPointer<string, smart_pointer::single_threaded>) == sizeof(void*));
+}
+
+template<bool Fast>
+void check_static_avl_tree() {
+    static_avl_tree<int, int, std::uint16_t, 64, Fast> tree;
+    std::map<int, int> reference;
+    std::minstd_rand rng(7);
+    for (int step = 0; step < 5000; ++step) {
+        int key = static_cast<int>(rng() % 100);
+        if (rng() % 2) {
+            auto it = tree.insert(key, step);
+            if (reference.count(key) == 0 && reference.size() == 64) {
+                REQUIRE(it == tree.end());
+                continue;
+            }
+            reference.emplace(key, step);
+            REQUIRE(it.key() == key);
+            REQUIRE(*it == reference[key]);
+        } else {
+            REQUIRE(tree.erase(key) == (reference.erase(key) == 1));
+        }
+        REQUIRE(tree.size() == reference.size());
+    }
+
+    auto ref = reference.begin();
+    for (auto it = tree.begin(); it != tree.end(); ++it, ++ref) {
+        REQUIRE(it.key() == ref->first);
+        REQUIRE(*it == ref->second);
+    }
+    REQUIRE(ref == reference.end());
+    auto last = tree.end();
+    --last;
+    REQUIRE(last.key() == reference.rbegin()->first);
+
+    auto it = tree.begin();
+    int first = it.key();
+    REQUIRE(it.load() == reference.begin()->second);
+    {
+        auto g = it.guard();
+        REQUIRE(*g == reference.begin()->second);
+        REQUIRE(g.key() == first);
+    }
+    tree.erase(first);
+    REQUIRE_THROWS_AS(*it, smart_pointer::exception);
+    REQUIRE_THROWS_AS(it.load(), smart_pointer::exception);
+    REQUIRE_THROWS_AS(it.guard(), smart_pointer::exception);
+    REQUIRE((++it).key() == std::next(reference.begin())->first);
+
+    tree.clear();
+    tree.insert(0, 0);
+    tree.insert(3, 3);
+    REQUIRE(!tree.erase(tree.find(7)));
+    REQUIRE(tree.size() == 2);
+    REQUIRE(tree.erase(tree.find(3)));
+    REQUIRE(tree.size() == 1);
+
+    tree.clear();
+    REQUIRE(tree.empty());
+    for (int i = 0; i < 64; ++i)
+        REQUIRE(tree.insert(i, i) != tree.end());
+    REQUIRE(tree.full());
+    REQUIRE(tree.insert(100, 100) == tree.end());
+}
+
+TEST_CASE("static_avl_tree") {
+    check_static_avl_tree<false>();
+    check_static_avl_tree<true>();
+}
+
+TEST_CASE("freeze") {
+    avl_tree<int, string> tree;
+    REQUIRE(tree.freeze().empty());
+    for (int i = 0; i < 1000; i += 3) tree.insert(i, std::to_string(i));
+
+    frozen_tree<int, string> frozen = tree.freeze();
+    tree.clear();
+    REQUIRE(frozen.size() == 334);
+
+    int expected = 0;
+    for (auto it = frozen.begin(); it != frozen.end(); ++it, expected += 3) {
+        REQUIRE(it.key() == expected);
+        REQUIRE(*it == std::to_string(expected));
+    }
+    REQUIRE(expected == 1002);
+
+    auto last = frozen.end();
+    for (expected = 999; expected >= 0; expected -= 3)
+        REQUIRE((--last).key() == expected);
+    REQUIRE((--last) == frozen.end());
+
+    for (int key = -1; key < 1001; ++key) {
+        auto lb = frozen.lower_bound(key);
+        int next = key < 0 ? 0 : (key + 2) / 3 * 3;
+        if (next > 999)
+            REQUIRE(lb == frozen.end());
+        else
+            REQUIRE(lb.key() == next);
+        REQUIRE((frozen.find(key) != frozen.end()) == (key >= 0 && key % 3 == 0));
+    }
+
+    avl_tree<int, int> live;
+    live.insert(10, 1);
+    live.insert(20, 2);
+    REQUIRE(live.lower_bound(15).key() == 20);
+    REQUIRE(live.lower_bound(20).key() == 20);
+    REQUIRE(live.lower_bound(21) == live.end());
+}
+
+TEST_CASE("extrema") {
+    avl_tree<int, int> tree;
+    REQUIRE(tree.min() == tree.end());
+    REQUIRE(tree.max() == tree.end());
+    REQUIRE(!tree.pop_min());
+
+    for (int i : {5, 3, 8, 1, 9, 7}) tree.insert(i, i * 10);
+    tree.post_insert(0, 0);
+    REQUIRE(tree.min().key() == 0);
+    REQUIRE(tree.max().key() == 9);
+
+    tree.erase(0);
+    tree.erase(9);
+    REQUIRE(tree.begin().key() == 1);
+    REQUIRE(tree.max().key() == 8);
+
+    auto lo = tree.pop_min();
+    REQUIRE(lo);
+    REQUIRE(lo->first == 1);
+    REQUIRE(lo->second == 10);
+    REQUIRE(tree.pop_max()->first == 8);
+
+    vector<int> drained;
+    while (auto e = tree.pop_min())
+        drained.push_back(e->first);
+    REQUIRE(drained == vector<int>({3, 5, 7}));
+    REQUIRE(tree.empty());
+    REQUIRE(tree.begin() == tree.end());
+}
+
+TEST_CASE("reverse iteration") {
+    avl_tree<int, int> tree;
+    REQUIRE(tree.rbegin() == tree.rend());
+    for (int i = 0; i < 100; ++i) tree.insert(i, i * 2);
+
+    auto last = tree.end();
+    REQUIRE((--last).key() == 99);
+
+    int expected = 99;
+    for (auto it = tree.rbegin(); it != tree.rend(); ++it, --expected) {
+        REQUIRE(it.key() == expected);
+        REQUIRE(*it == expected * 2);
+    }
+    REQUIRE(expected == -1);
+
+    // latest 5, erasing under the iterator
+    vector<int> latest;
+    auto it = tree.rbegin();
+    for (int i = 0; i < 5; ++i) {
+        latest.push_back(it.key());
+        tree.erase(it.key());
+        ++it;
+    }
+    REQUIRE(latest == vector<int>({99, 98, 97, 96, 95}));
+    REQUIRE(it.key() == 94);
+    REQUIRE((--it) == tree.rend());  // nothing above 94 is left
+    auto rend = tree.rend();
+    REQUIRE((--rend).key() == 0);
+    REQUIRE((++rend) == tree.rend());
+}
+
+TEST_CASE("split and join") {
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 1000; ++i) tree.insert(i, i);
+    auto it = tree.find(700);
+
+    avl_tree<int, int> upper = tree.split(600);
+    REQUIRE(tree.size() == 600);
+    REQUIRE(upper.size() == 400);
+    REQUIRE(tree.max().key() == 599);
+    REQUIRE(upper.min().key() == 600);
+    REQUIRE(tree.find(700) == tree.end());
+    REQUIRE(upper.find(700).key() == 700);
+    REQUIRE((++it) == tree.end());  // its node moved to the other tree
+
+    int expected = 600;
+    for (auto u = upper.begin(); u != upper.end(); ++u, ++expected)
+        REQUIRE(u.key() == expected);
+    REQUIRE(expected == 1000);
+
+    avl_tree<int, int> overlapping;
+    overlapping.insert(10, 10);
+    REQUIRE_THROWS_AS(tree.join(overlapping), std::invalid_argument);
+    REQUIRE(overlapping.size() == 1);
+
+    tree.join(upper);
+    REQUIRE(upper.empty());
+    REQUIRE(tree.size() == 1000);
+    expected = 0;
+    for (auto t = tree.begin(); t != tree.end(); ++t, ++expected)
+        REQUIRE(t.key() == expected);
+    REQUIRE(expected == 1000);
+
+    REQUIRE(tree.erase(100, 200) == 100);
+    REQUIRE(tree.size() == 900);
+    REQUIRE(tree.find(150) == tree.end());
+    REQUIRE(tree.find(99) != tree.end());
+    REQUIRE(tree.find(200) != tree.end());
+    REQUIRE(tree.erase(2000, 3000) == 0);
+
+    avl_tree<int, int> lower;
+    for (int i = -50; i < 0; ++i) lower.insert(i, i);
+    tree.join(lower);
+    REQUIRE(tree.min().key() == -50);
+    REQUIRE(tree.size() == 950);
+
+    // joining many small trees keeps the result balanced enough to walk
+    avl_tree<int, int> grown;
+    for (int block = 0; block < 50; ++block) {
+        avl_tree<int, int> part;
+        for (int i = 0; i < block; ++i) part.insert(block * 100 + i, i);
+        grown.join(part);
+    }
+    REQUIRE(grown.size() == 49 * 50 / 2);
+    int count = 0;
+    for (auto g = grown.rbegin(); g != grown.rend(); ++g) ++count;
+    REQUIRE(count == 49 * 50 / 2);
+}
+
+TEST_CASE("set operations") {
+    std::minstd_rand rng(3);
+    auto fill = [&rng](avl_tree<int, int>& tree, std::map<int, int>& ref, int n, int value) {
+        for (int i = 0; i < n; ++i) {
+            int key = static_cast<int>(rng() % 60000);
+            tree.insert(key, value);
+            ref.emplace(key, value);
+        }
+    };
+    auto same = [](avl_tree<int, int>& tree, const std::map<int, int>& ref) {
+        if (tree.size() != ref.size()) return false;
+        auto r = ref.begin();
+        for (auto it = tree.begin(); it != tree.end(); ++it, ++r)
+            if (it.key() != r->first || *it != r->second) return false;
+        return true;
+    };
+
+    for (int small : {0, 100, 20000}) {
+        avl_tree<int, int> base, delta;
+        std::map<int, int> base_ref, delta_ref;
+        fill(base, base_ref, 30000, 1);
+        fill(delta, delta_ref, small, 2);
+
+        avl_tree<int, int> base2(base), delta2(delta), base3(base), delta3(delta);
+
+        base.merge(delta);
+        std::map<int, int> merged = delta_ref;
+        merged.insert(base_ref.begin(), base_ref.end());
+        REQUIRE(delta.empty());
+        REQUIRE(same(base, merged));
+
+        base2.intersect(delta2);
+        std::map<int, int> common;
+        for (auto& e : base_ref)
+            if (delta_ref.count(e.first)) common.insert(e);
+        REQUIRE(same(base2, common));
+
+        base3.subtract(delta3);
+        std::map<int, int> rest;
+        for (auto& e : base_ref)
+            if (!delta_ref.count(e.first)) rest.insert(e);
+        REQUIRE(same(base3, rest));
+    }
+}
+
+TEST_CASE("parallel_for_each") {
+    avl_tree<int, int> tree;
+    for (int i = 0; i < 100000; ++i) tree.insert(i, 1);
+
+    for (unsigned threads : {1u, 3u, 8u}) {
+        vector<std::atomic<int>> seen(100000);
+        std::atomic<long> sum(0);
+        tree.parallel_for_each([&](const int& key, const int& value) {
+            seen[key]++;
+            sum += value;
+        }, threads);
+        REQUIRE(sum == 100000);
+        int wrong = 0;
+        for (auto& s : seen)
+            if (s != 1) ++wrong;
+        REQUIRE(wrong == 0);
+    }
+
+    // every thread walks its range in key order
+    std::mutex m;
+    std::map<std::thread::id, vector<int>> ranges;
+    tree.parallel_for_each([&](const int& key, const int&) {
+        std::lock_guard lock(m);
+        ranges[std::this_thread::get_id()].push_back(key);
+    }, 4);
+    REQUIRE(ranges.size() == 4);
+    for (auto& r : ranges)
+        REQUIRE(std::is_sorted(r.second.begin(), r.second.end()));
+
+    REQUIRE_THROWS_AS(tree.parallel_for_each([](const int& key, const int&) {
+        if (key == 5000) throw std::runtime_error("stop");
+    }, 4), std::runtime_error);
+
+    avl_tree<int, int> empty;
+    empty.parallel_for_each([](const int&, const int&) { FAIL(); }, 4);
+}
+
+TEST_CASE("parallel construction") {
+    std::minstd_rand rng(11);
+    vector<std::pair<int, int>> dump;
+    std::map<int, int> reference;
+    for (int i = 0; i < 50000; ++i) {
+        int key = static_cast<int>(rng() % 40000);
+        dump.emplace_back(key, i);
+        reference.emplace(key, i);  // the first occurrence wins
+    }
+
+    for (unsigned threads : {1u, 4u, 7u}) {
+        avl_tree<int, int> tree(dump.begin(), dump.end(), threads);
+        REQUIRE(tree.size() == reference.size());
+        auto r = reference.begin();
+        int wrong = 0;
+        for (auto it = tree.begin(); it != tree.end(); ++it, ++r)
+            if (it.key() != r->first || *it != r->second) ++wrong;
+        REQUIRE(wrong == 0);
+        REQUIRE(tree.max().key() == reference.rbegin()->first);
+    }
+
+    vector<std::pair<int, int>> none;
+    avl_tree<int, int> empty(none.begin(), none.end(), 4);
+    REQUIRE(empty.empty());
+    REQUIRE(empty.begin() == empty.end());
+
+    // remembers every thread that copied one, i.e. that sorted or built nodes
+    struct traced {
+        static std::mutex& lock() { static std::mutex m; return m; }
+        static std::set<std::thread::id>& ids() { static std::set<std::thread::id> s; return s; }
+        traced() = default;
+        traced(const traced&) {
+            std::lock_guard guard(lock());
+            ids().insert(std::this_thread::get_id());
+        }
+        traced& operator=(const traced&) = default;
+    };
+    vector<std::pair<int, traced>> items(20000);
+    for (int i = 0; i < 20000; ++i) items[i].first = i;
+
+    traced::ids().clear();
+    avl_tree<int, traced> one(items.begin(), items.end(), 1);
+    REQUIRE(traced::ids() == std::set<std::thread::id>{std::this_thread::get_id()});
+
+    traced::ids().clear();
+    avl_tree<int, traced, smart_pointer::single_threaded> local(items.begin(), items.end(), 8);
+    REQUIRE(traced::ids() == std::set<std::thread::id>{std::this_thread::get_id()});
+}
+
+TEST_CASE("upsert and modify") {
+    avl_tree<string, int> counters;
+    for (int i = 0; i < 10; ++i)
+        counters.upsert(i % 2 ? "odd" : "even", [](int& v) { ++v; });
+    REQUIRE(counters.size() == 2);
+    REQUIRE(*counters.find("odd") == 5);
+
+    REQUIRE(counters.modify("even", [](int& v) { v *= 10; }));
+    REQUIRE(*counters.find("even") == 50);
+    REQUIRE(!counters.modify("none", [](int&) { FAIL(); }));
+    REQUIRE(counters.size() == 2);
+
+    int made = 0;
+    REQUIRE(counters.compute_if_absent("odd", [&made]() { ++made; return 0; }) == 5);
+    REQUIRE(counters.compute_if_absent("new", [&made]() { ++made; return 7; }) == 7);
+    REQUIRE(made == 1);
+    REQUIRE(counters.min().key() == "even");
+    REQUIRE(counters.max().key() == "odd");
+
+    avl_tree<int, long> shared;
+    vector<thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&shared]() {
+            for (int i = 0; i < 1000; ++i)
+                shared.upsert(i % 10, [](long& v) { ++v; });
+        });
+    for (auto& t : threads)
+        t.join();
+    REQUIRE(shared.size() == 10);
+    long total = 0;
+    for (auto it = shared.begin(); it != shared.end(); ++it)
+        total += *it;
+    REQUIRE(total == 4000);
+}
+
+TEST_CASE("flat combining") {
+    avl_tree<int, int> tree;
+    tree.start_flat_combining();
+
+    int n = 8;
+    vector<thread> threads;
+    std::atomic<int> failures(0);
+    for (int t = 0; t < n; ++t)
+        threads.emplace_back([&tree, &failures, t]() {
+            for (int i = t; i < 4000; i += 8) {
+                auto it = tree.insert(i, i * 2);
+                if (it.key() != i || *it != i * 2) failures++;
+            }
+            for (int i = t; i < 4000; i += 16)
+                if (!tree.erase(i)) failures++;
+            if (tree.erase(-1)) failures++;
+        });
+    for (auto& t : threads)
+        t.join();
+    REQUIRE(failures == 0);
+    REQUIRE(tree.size() == 2000);
+
+    int previous = -1;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        REQUIRE(it.key() % 16 >= 8);
+        REQUIRE(previous < it.key());
+        previous = it.key();
+    }
+
+    REQUIRE(tree.insert(8, 0).val() == 16);  // still insert-if-absent
+    tree.stop_flat_combining();
+    REQUIRE(tree.erase(8));
+    REQUIRE(tree.size() == 1999);
+}
+
+TEST_CASE("hazard pointers") {
+    static int reclaimed;
+    reclaimed = 0;
+    auto reclaim = [](void* p) {
+        delete static_cast<int*>(p);
+        reclaimed++;
+    };
+
+    hazard_pointer::domain domain(4);
+    int* kept = new int(7);
+    {
+        hazard_pointer::guard g(domain);
+        g.set(kept);
+        domain.retire(kept, reclaim);
+        domain.retire(new int(1), reclaim);
+        domain.retire(new int(2), reclaim);
+        REQUIRE(reclaimed == 0);
+
+        // the fourth retired node reaches the threshold and triggers a scan,
+        // which frees everything but the guarded node
+        domain.retire(new int(3), reclaim);
+        REQUIRE(reclaimed == 3);
+        REQUIRE(*kept == 7);
+        REQUIRE(domain.scan() == 0);
+    }
+    REQUIRE(domain.scan() == 1);
+    REQUIRE(reclaimed == 4);
+}
+
+TEST_CASE("fine-grained list frees its nodes") {
+    {
+        list<counted> l;
+        for (int i = 0; i < 1000; ++i) l.push_back(counted());
+        auto it = l.begin();
+        ++it;
+        l.erase(it);
+        l.pop_front();
+        l.pop_back();
+        REQUIRE(l.size() == 997);
+    }
+    REQUIRE(counted::alive() == 0);
+
+    {
+        list<counted> l;
+        for (int i = 0; i < 1000; ++i) l.push_back(counted());
+        vector<thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back([&l]() {
+                for (int i = 0; i < 200; ++i) {
+                    l.pop_front();
+                    l.push_back(counted());
+                }
+            });
+        for (auto& t : threads) t.join();
+        REQUIRE(l.size() == 1000);
+    }
+    REQUIRE(counted::alive() == 0);
+}
@@ -1,8 +1,16 @@
+#pragma once
+
 #include <memory>
+#include <new>
 #include <utility>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <shared_mutex>
+#include <thread>
+#include <type_traits>
 
 namespace smart_pointer {
     class exception : std::exception {
@@ -10,25 +18,357 @@ namespace smart_pointer {
         using base_class::base_class;
     };
 
+    // lock with nothing to lock, for pointers and trees confined to one thread
+    struct null_mutex {
+        void lock() {}
+        bool try_lock() { return true; }
+        void unlock() {}
+        void lock_shared() {}
+        bool try_lock_shared() { return true; }
+        void unlock_shared() {}
+    };
+
+    // where control blocks (and objects from make_smart) are allocated
+    struct heap_allocator {
+        template<std::size_t Size, std::size_t Align>
+        static void* allocate() {
+            if constexpr (Align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                return ::operator new(Size, std::align_val_t(Align));
+            else
+                return ::operator new(Size);
+        }
+
+        template<std::size_t Size, std::size_t Align>
+        static void deallocate(void* p) {
+            if constexpr (Align > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+                ::operator delete(p, std::align_val_t(Align));
+            else
+                ::operator delete(p);
+        }
+    };
+
+    // Per-thread free lists, one per block size. A freed block is kept by the
+    // thread that frees it, up to Capacity blocks per size, and handed out
+    // again by its next allocation of that size without going to malloc.
+    // Past that, half of the list moves to a depot shared by all threads,
+    // where threads that run dry refill from, so blocks freed on one thread
+    // (e.g. by the deferred_reclaimer) find their way back to the threads
+    // that allocate. A thread's list goes to the depot when the thread exits.
+    template<std::size_t Capacity = 4096>
+    struct pool_allocator {
+        template<std::size_t Size, std::size_t Align>
+        static void* allocate() {
+            auto& list = _list<Size, Align>();
+            if (list.head == nullptr && !list.closed)
+                _refill(list);
+            if (list.head == nullptr)
+                return _depot<Size, Align>().take_one();
+            return list.pop();
+        }
+
+        template<std::size_t Size, std::size_t Align>
+        static void deallocate(void* p) {
+            auto& list = _list<Size, Align>();
+            if (list.closed) {
+                _depot<Size, Align>().give(new (p) free_block{nullptr});
+                return;
+            }
+            list.push(p);
+            if (list.count > Capacity)
+                _spill(list, _batch);
+        }
+
+    private:
+        static constexpr std::size_t _batch = Capacity / 2 > 0 ? Capacity / 2 : 1;
+
+        struct free_block {
+            free_block* next;
+        };
+
+        // Trivially destructible, so it stays usable while and after the
+        // thread's other thread_locals are destroyed; `closed` then sends
+        // everything through the depot.
+        template<std::size_t Size, std::size_t Align>
+        struct free_list {
+            static_assert(Size >= sizeof(free_block), "block too small for the free list link");
+
+            free_block* head;
+            std::size_t count;
+            bool registered;
+            bool closed;
+
+            void push(void* p) {
+                head = new (p) free_block{head};
+                count++;
+            }
+
+            void* pop() {
+                free_block* b = head;
+                head = b->next;
+                count--;
+                return b;
+            }
+        };
+
+        // hands the thread's blocks to the depot when the thread exits
+        template<std::size_t Size, std::size_t Align>
+        struct list_owner {
+            free_list<Size, Align>& list;
+
+            ~list_owner() {
+                _spill(list, list.count);
+                list.closed = true;
+            }
+        };
+
+        // Blocks shared by all threads, at most 8 * Capacity per size. Never
+        // destroyed, so it still takes blocks freed by static destructors.
+        template<std::size_t Size, std::size_t Align>
+        struct depot {
+            std::mutex m;
+            free_block* head = nullptr;
+            std::size_t count = 0;
+
+            // takes a chain of blocks, frees what does not fit
+            void give(free_block* first) {
+                std::unique_lock lock(m);
+                while (first != nullptr && count >= 8 * Capacity) {
+                    free_block* next = first->next;
+                    heap_allocator::deallocate<Size, Align>(first);
+                    first = next;
+                }
+                while (first != nullptr) {
+                    free_block* next = first->next;
+                    first->next = head;
+                    head = first;
+                    count++;
+                    first = next;
+                }
+            }
+
+            void* take_one() {
+                {
+                    std::unique_lock lock(m);
+                    if (head != nullptr) {
+                        free_block* b = head;
+                        head = b->next;
+                        count--;
+                        return b;
+                    }
+                }
+                return heap_allocator::allocate<Size, Align>();
+            }
+        };
+
+        template<std::size_t Size, std::size_t Align>
+        static free_list<Size, Align>& _list() {
+            thread_local free_list<Size, Align> list{};
+            if (!list.registered) {
+                list.registered = true;
+                thread_local list_owner<Size, Align> owner{list};
+                (void)owner;
+            }
+            return list;
+        }
+
+        template<std::size_t Size, std::size_t Align>
+        static depot<Size, Align>& _depot() {
+            static depot<Size, Align>* d = new depot<Size, Align>();
+            return *d;
+        }
+
+        // moves up to n blocks from the thread's list to the depot
+        template<std::size_t Size, std::size_t Align>
+        static void _spill(free_list<Size, Align>& list, std::size_t n) {
+            if (n == 0 || list.head == nullptr)
+                return;
+            free_block* first = list.head;
+            free_block* last = first;
+            std::size_t moved = 1;
+            while (moved < n && last->next != nullptr) {
+                last = last->next;
+                moved++;
+            }
+            list.head = last->next;
+            list.count -= moved;
+            last->next = nullptr;
+            _depot<Size, Align>().give(first);
+        }
+
+        // takes up to a batch of blocks from the depot into the thread's list
+        template<std::size_t Size, std::size_t Align>
+        static void _refill(free_list<Size, Align>& list) {
+            auto& d = _depot<Size, Align>();
+            std::unique_lock lock(d.m);
+            for (std::size_t i = 0; i < _batch && d.head != nullptr; ++i) {
+                free_block* b = d.head;
+                d.head = b->next;
+                d.count--;
+                list.push(b);
+            }
+        }
+    };
+
+    // Threading policies: how a SmartPointer keeps its reference count, and
+    // the lock containers built on it (avl_tree) use.
+    struct multi_threaded {
+        using counter_type = std::atomic<std::size_t>;
+        using mutex_type = std::shared_mutex;
+        using allocator = heap_allocator;
+        static constexpr bool thread_safe = true;
+        static constexpr bool deferred_destruction = false;
+    };
+
+    // plain counter and no locking, for objects that never leave their thread
+    struct single_threaded {
+        using counter_type = std::size_t;
+        using mutex_type = null_mutex;
+        using allocator = heap_allocator;
+        static constexpr bool thread_safe = false;
+        static constexpr bool deferred_destruction = false;
+    };
+
+    // recycles control blocks and make_smart objects through pool_allocator
+    template<typename Base = multi_threaded, std::size_t Capacity = 4096>
+    struct pooled : Base {
+        using allocator = pool_allocator<Capacity>;
+    };
+
+    // Dropping the last reference only queues the object; deferred_reclaimer
+    // destroys it later, in bounded batches, so freeing a large structure never
+    // runs inline on the thread (and under the locks) that let go of it.
+    // The reclaimer is shared by all threads, so the base must be thread-safe.
+    template<typename Base = multi_threaded>
+    struct deferred : Base {
+        static_assert(Base::thread_safe,
+                      "deferred destruction runs on the shared reclaimer and needs a thread-safe base policy");
+        static constexpr bool deferred_destruction = true;
+    };
+
+    // intrusive link of an object waiting in the deferred_reclaimer
+    struct deferred_hook {
+        deferred_hook* next = nullptr;
+        void (*dispose)(deferred_hook*) = nullptr;
+    };
+
+    struct no_hook {};
+
+    // Process-wide queue of objects whose last SmartPointer is gone (see
+    // `deferred`). Releasing threads only push; objects are destroyed by
+    // collect(), called at safe points or by the background thread.
+    class deferred_reclaimer {
+        std::atomic<deferred_hook*> _incoming{nullptr};
+        std::atomic<std::size_t> _pending{0};
+        // taken from _incoming but not destroyed yet, owned by _collect
+        deferred_hook* _backlog = nullptr;
+        std::mutex _collect;
+
+        std::mutex _m;
+        std::condition_variable _cv;
+        bool _stopped = true;
+        std::thread _worker;
+
+        deferred_reclaimer() = default;
+
+        void run(std::chrono::milliseconds period, std::size_t batch) {
+            std::unique_lock lock(_m);
+            while (!_cv.wait_for(lock, period, [this] { return _stopped; })) {
+                lock.unlock();
+                while (collect(batch) == batch) {}
+                lock.lock();
+            }
+        }
+
+    public:
+        deferred_reclaimer(const deferred_reclaimer&) = delete;
+        deferred_reclaimer& operator=(const deferred_reclaimer&) = delete;
+
+        ~deferred_reclaimer() {
+            stop();
+            while (collect(std::size_t(-1)) != 0) {}
+        }
+
+        static deferred_reclaimer& instance() {
+            static deferred_reclaimer reclaimer;
+            return reclaimer;
+        }
+
+        void push(deferred_hook* hook) {
+            hook->next = _incoming.load(std::memory_order_relaxed);
+            while (!_incoming.compare_exchange_weak(hook->next, hook, std::memory_order_release,
+                                                    std::memory_order_relaxed));
+            _pending++;
+        }
+
+        // Destroys up to `max_objects` queued objects and returns how many it
+        // destroyed. Destroying an object may queue what it owned; those are
+        // picked up by later calls, so a whole tree is freed iteratively.
+        std::size_t collect(std::size_t max_objects = 1024) {
+            std::lock_guard lock(_collect);
+            std::size_t done = 0;
+            while (done < max_objects) {
+                if (_backlog == nullptr) {
+                    _backlog = _incoming.exchange(nullptr, std::memory_order_acquire);
+                    if (_backlog == nullptr)
+                        break;
+                }
+                deferred_hook* hook = _backlog;
+                _backlog = hook->next;
+                hook->dispose(hook);
+                _pending--;
+                ++done;
+            }
+            return done;
+        }
+
+        std::size_t pending() const {
+            return _pending;
+        }
+
+        // collects `batch` objects at a time every `period` on a background thread
+        void start(std::chrono::milliseconds period, std::size_t batch = 1024) {
+            std::lock_guard lock(_m);
+            if (!_stopped)
+                return;
+            _stopped = false;
+            _worker = std::thread(&deferred_reclaimer::run, this, period, batch);
+        }
+
+        void stop() {
+            {
+                std::lock_guard lock(_m);
+                if (_stopped)
+                    return;
+                _stopped = true;
+            }
+            _cv.notify_one();
+            _worker.join();
+        }
+    };
+
 // `SmartPointer` class declaration
     template<
-            typename T
+            typename T,
+            typename Policy = multi_threaded
     >
     class SmartPointer {
+        // One pointer wide: the reference count lives in the control block.
+        // As with std::shared_ptr, different SmartPointers to one object can be
+        // copied and dropped concurrently, a single SmartPointer object cannot
+        // be written while others read it.
 
     public:
         using value_type = T;
 
         explicit SmartPointer(value_type* ptr = nullptr) {
             if (ptr != nullptr)
-                core = new Core(ptr);
+                core = create<Core>(ptr);
             else
                 core = nullptr;
         }
 
         // copy constructor
         SmartPointer(const SmartPointer& src){
-            std::shared_lock lock(src._m);
             core = src.core;
             if (core != nullptr && core->ptr != nullptr)
                 core->count++;
@@ -41,34 +381,24 @@ namespace smart_pointer {
 
         // copy assigment
         SmartPointer& operator=(const SmartPointer& rhs) {
-            std::unique_lock lock(_m);
-            tmp();
             if (rhs.core != nullptr)
                 rhs.core->count++;
+            tmp();
             core = rhs.core;
             return *this;
         }
 
+        // drops this pointer's reference, the last owner destroys the object
         void tmp() {
-            if (core != nullptr) {
-                if (core->ptr != nullptr) {
-                    core->count--;
-                    if (core->count == 0) {
-                        //core->alloc.deallocate(core->ptr, 1);
-                        delete core->ptr;
-                        core->ptr = nullptr;
-                        delete core;
-                        core = nullptr;
-                    }
-                } else {
-                    delete core;
-                    core = nullptr;
-                }
-            }
+            if (core != nullptr && --core->count == 0)
+                last_owner_gone(core);
+            core = nullptr;
         }
 
         // move assigment
         SmartPointer& operator=(SmartPointer&& rhs) {
+            if (this == &rhs)
+                return *this;
             tmp();
 
             this->core = std::move(rhs.core);
@@ -78,36 +408,27 @@ namespace smart_pointer {
 
         //
         SmartPointer& operator=(value_type* rhs) {
-            std::unique_lock lock(_m);
             tmp();
 
             if (rhs != nullptr)
-                core = new Core(rhs);
+                core = create<Core>(rhs);
             else
                 core = nullptr;
             return *this;
         }
 
         ~SmartPointer() {
-            //std::unique_lock lock(_m); need??
-            if (core != nullptr) {
-                core->count--;
-                if (core->count == 0) {
-                    //core->alloc.deallocate(core->ptr, 1);
-                    delete core->ptr;
-                    core->ptr = nullptr;
-                    delete core;
-                    core = nullptr;
-                }
-            } else {
-                delete core;
-            }
+            tmp();
         }
 
+        // Observers are plain loads of `core` and take no lock: they run at
+        // every step of a tree descent. Reading a SmartPointer while another
+        // thread assigns to it is a race; share it through
+        // atomic_smart_pointer (or an outer lock) instead.
+
         // return reference to the object of class/type T
         // if SmartPointer contains nullptr throw `SmartPointer::exception`
         value_type& operator*() {
-            std::shared_lock lock(_m);
             if (core == nullptr || core->ptr == nullptr) {
                 throw smart_pointer::exception();
             }
@@ -115,7 +436,6 @@ namespace smart_pointer {
             return *(core->ptr);
         }
         const value_type& operator*() const {
-            std::shared_lock lock(_m);
             if (core == nullptr || core->ptr == nullptr) {
                 throw smart_pointer::exception();
             }
@@ -125,42 +445,38 @@ namespace smart_pointer {
 
         // return pointer to the object of class/type T
         value_type* operator->() const {
-            std::shared_lock lock(_m);
             if (core == nullptr)
                 return nullptr;
             return core->ptr;
         }
 
         value_type* get() const {
-            //std::shared_lock lock(_m);
             if (!core)
                 return nullptr;
             return core->ptr;
         }
 
+        // address of the control block, read without touching the block, for
+        // prefetching; an object from make_smart lives in the same block
+        const void* block() const {
+            return core;
+        }
+
         // if pointer == nullptr => return false
         operator bool() const {
-            std::shared_lock lock(_m);
             return !(core == nullptr || core->ptr == nullptr);
         }
 
         // if pointers points to the same address or both null => true
         template<typename U>
-        bool operator==(const SmartPointer<U>& rhs) const {
-            std::scoped_lock lock(_m, rhs._m);
-            if (!core && !rhs.get())
-                return true;
-            if (((core == nullptr) && (rhs.get() != nullptr)) ||
-                ((core != nullptr) && (rhs.get() == nullptr)))
-                return false;
-            return (static_cast<void*>(core->ptr) ==
-                    static_cast<void*>(rhs.get()));
+        bool operator==(const SmartPointer<U, Policy>& rhs) const {
+            return static_cast<const void*>(get()) == static_cast<const void*>(rhs.get());
         }
 
 
         // if pointers points to the same address or both null => false
         template<typename U>
-        bool operator!=(const SmartPointer<U>& rhs) const {
+        bool operator!=(const SmartPointer<U, Policy>& rhs) const {
             return !(*this == rhs);
         }
 
@@ -173,7 +489,14 @@ namespace smart_pointer {
         }
 
     private:
-        class Core {
+        template<typename U, typename P, typename... Args>
+        friend SmartPointer<U, P> make_smart(Args&&... args);
+        template<typename U>
+        friend class atomic_smart_pointer;
+        template<typename U, typename P>
+        friend class WeakPointer;
+
+        class Core : public std::conditional_t<Policy::deferred_destruction, deferred_hook, no_hook> {
         public:
             explicit Core(T* ptr) : ptr(ptr) {
                 if (this->ptr != nullptr)
@@ -181,10 +504,362 @@ namespace smart_pointer {
             }
 
             T* ptr;
-            //Allocator alloc;
-            std::atomic<size_t> count = 0;
+            typename Policy::counter_type count = 0;
+            // WeakPointers plus one for all the strong owners together; the
+            // block is freed when it drops to zero
+            typename Policy::counter_type weak = 1;
+            // ptr lives in the same allocation (see make_smart)
+            bool inplace = false;
+        };
+
+        // control block and object in one allocation
+        class Block : public Core {
+        public:
+            Block() : Core(nullptr) {}
+
+            alignas(T) unsigned char storage[sizeof(T)];
         };
+
+        // control blocks come from the policy's allocator
+        template<typename B, typename... Args>
+        static B* create(Args&&... args) {
+            void* mem = Policy::allocator::template allocate<sizeof(B), alignof(B)>();
+            try {
+                return new (mem) B(std::forward<Args>(args)...);
+            } catch (...) {
+                Policy::allocator::template deallocate<sizeof(B), alignof(B)>(mem);
+                throw;
+            }
+        }
+
+        template<typename B>
+        static void free(B* block) {
+            block->~B();
+            Policy::allocator::template deallocate<sizeof(B), alignof(B)>(block);
+        }
+
+        static void last_owner_gone(Core* core) {
+            if constexpr (Policy::deferred_destruction) {
+                core->dispose = [](deferred_hook* hook) { destroy(static_cast<Core*>(hook)); };
+                deferred_reclaimer::instance().push(core);
+            } else {
+                destroy(core);
+            }
+        }
+
+        // the last strong owner is gone: destroy the object, keep the block
+        // while WeakPointers still look at it
+        static void destroy(Core* core) {
+            if (core->inplace) {
+                core->ptr->~T();
+            } else {
+                delete core->ptr;
+                core->ptr = nullptr;
+            }
+            release_weak(core);
+        }
+
+        static void release_weak(Core* core) {
+            if (--core->weak != 0)
+                return;
+            if (core->inplace)
+                free(static_cast<Block*>(core));
+            else
+                free(core);
+        }
+
+        // takes a strong reference unless the object is already gone
+        static bool try_acquire(Core* core) {
+            if constexpr (Policy::thread_safe) {
+                std::size_t n = core->count.load();
+                do {
+                    if (n == 0)
+                        return false;
+                } while (!core->count.compare_exchange_weak(n, n + 1));
+                return true;
+            } else {
+                if (core->count == 0)
+                    return false;
+                core->count++;
+                return true;
+            }
+        }
+
+        Core* core;
+    };
+
+    // Non-owning observer of a SmartPointer's object. It keeps only the control
+    // block alive (for objects from make_smart, the block's storage too, like
+    // std::weak_ptr), so whatever the object itself owns is freed as soon as the
+    // last SmartPointer goes.
+    template<typename T, typename Policy = multi_threaded>
+    class WeakPointer {
+        using pointer = SmartPointer<T, Policy>;
+        using Core = typename pointer::Core;
+
+    public:
+        using value_type = T;
+
+        WeakPointer() : core(nullptr) {}
+
+        WeakPointer(const pointer& src) {
+            core = src.core;
+            if (core != nullptr)
+                core->weak++;
+        }
+
+        // copy constructor
+        WeakPointer(const WeakPointer& src) {
+            core = src.core;
+            if (core != nullptr)
+                core->weak++;
+        }
+
+        // move constructor
+        WeakPointer(WeakPointer&& src) : core(src.core) {
+            src.core = nullptr;
+        }
+
+        // copy assigment
+        WeakPointer& operator=(const WeakPointer& rhs) {
+            if (rhs.core != nullptr)
+                rhs.core->weak++;
+            reset();
+            core = rhs.core;
+            return *this;
+        }
+
+        // move assigment
+        WeakPointer& operator=(WeakPointer&& rhs) {
+            if (this == &rhs)
+                return *this;
+            reset();
+            core = rhs.core;
+            rhs.core = nullptr;
+            return *this;
+        }
+
+        ~WeakPointer() {
+            reset();
+        }
+
+        void reset() {
+            if (core != nullptr)
+                pointer::release_weak(core);
+            core = nullptr;
+        }
+
+        // strong pointer to the object, or an empty one if it is gone
+        pointer lock() const {
+            pointer res;
+            if (core != nullptr && pointer::try_acquire(core))
+                res.core = core;
+            return res;
+        }
+
+        bool expired() const {
+            return core == nullptr || core->count == 0;
+        }
+
+        // both observe the same object (or nothing), alive or not
+        bool operator==(const WeakPointer& rhs) const {
+            return core == rhs.core;
+        }
+
+        bool operator!=(const WeakPointer& rhs) const {
+            return core != rhs.core;
+        }
+
+    private:
         Core* core;
-        mutable std::shared_mutex _m;
+    };
+
+    // Like std::make_shared: constructs T in the same allocation as its
+    // control block, one heap allocation and one cache line less per object.
+    template<typename T, typename Policy = multi_threaded, typename... Args>
+    SmartPointer<T, Policy> make_smart(Args&&... args) {
+        using pointer = SmartPointer<T, Policy>;
+        auto* block = pointer::template create<typename pointer::Block>();
+        try {
+            block->ptr = new (block->storage) T(std::forward<Args>(args)...);
+        } catch (...) {
+            pointer::free(block);
+            throw;
+        }
+        block->inplace = true;
+        block->count = 1;
+
+        pointer res;
+        res.core = block;
+        return res;
+    }
+
+    static_assert(sizeof(SmartPointer<int>) == sizeof(void*), "SmartPointer must stay one pointer wide");
+
+    // Lock-free shared slot holding a SmartPointer, the analogue of
+    // std::atomic<std::shared_ptr>, for fields that are read and replaced
+    // concurrently.
+    //
+    // Split reference count: the slot owns `reserved` references of the object
+    // it stores and packs, into the unused top 16 bits of the control block
+    // address, how many of them readers have already taken. load() is a single
+    // CAS on that word and never touches the shared count, except to top up the
+    // reservation once half of it is used. Whoever replaces the value returns
+    // the references nobody took.
+    //
+    // The lowest address bit (control blocks are at least 8-aligned) is a mark
+    // for lock-free linked structures: try_mark() freezes the stored value,
+    // after which compare_exchange_strong() fails until it is replaced with
+    // store() or exchange().
+    template<typename T>
+    class atomic_smart_pointer {
+        using pointer = SmartPointer<T>;
+        using Core = typename pointer::Core;
+
+        static_assert(sizeof(void*) == 8, "needs 64-bit pointers with 48 significant bits");
+        static constexpr int local_shift = 48;
+        static constexpr std::uint64_t local_one = std::uint64_t(1) << local_shift;
+        static constexpr std::uint64_t mark_bit = 1;
+        static constexpr std::uint64_t core_mask = (local_one - 1) & ~mark_bit;
+        static constexpr std::uint64_t reserved = std::uint64_t(1) << 15;
+
+        mutable std::atomic<std::uint64_t> _word;
+
+        static Core* _core(std::uint64_t word) {
+            return reinterpret_cast<Core*>(word & core_mask);
+        }
+
+        static std::uint64_t _taken(std::uint64_t word) {
+            return word >> local_shift;
+        }
+
+        static void _release(Core* core, std::uint64_t n) {
+            if (core != nullptr && n != 0 && core->count.fetch_sub(n) == n)
+                pointer::last_owner_gone(core);
+        }
+
+        // turns the single reference held by `desired` into a full reservation
+        static std::uint64_t _reserve(pointer& desired) {
+            Core* core = desired.core;
+            desired.core = nullptr;
+            if (core != nullptr)
+                core->count += reserved - 1;
+            return reinterpret_cast<std::uint64_t>(core);
+        }
+
+        static pointer _adopt(Core* core) {
+            pointer res;
+            res.core = core;
+            return res;
+        }
+
+    public:
+        atomic_smart_pointer() noexcept : _word(0) {}
+
+        explicit atomic_smart_pointer(pointer desired) : _word(_reserve(desired)) {}
+
+        atomic_smart_pointer(const atomic_smart_pointer&) = delete;
+        atomic_smart_pointer& operator=(const atomic_smart_pointer&) = delete;
+
+        ~atomic_smart_pointer() {
+            std::uint64_t word = _word.load(std::memory_order_relaxed);
+            _release(_core(word), reserved - _taken(word));
+        }
+
+        static constexpr bool is_lock_free() {
+            return std::atomic<std::uint64_t>::is_always_lock_free;
+        }
+
+        pointer load() const {
+            bool marked;
+            return load(marked);
+        }
+
+        // the stored value and, from the same read, whether it is marked
+        pointer load(bool& marked) const {
+            std::uint64_t word = _word.load(std::memory_order_acquire);
+            do {
+                marked = word & mark_bit;
+                if (_core(word) == nullptr)
+                    return pointer();
+                if (_taken(word) == reserved) {
+                    // another reader is topping the reservation up
+                    std::this_thread::yield();
+                    word = _word.load(std::memory_order_acquire);
+                    continue;
+                }
+            } while (!_word.compare_exchange_weak(word, word + local_one, std::memory_order_acquire,
+                                                  std::memory_order_acquire));
+            marked = word & mark_bit;
+
+            Core* core = _core(word);
+            if (_taken(word) + 1 >= reserved / 2) {
+                // we own a reference now, so core stays alive while we top up
+                std::uint64_t cur = word + local_one;
+                std::uint64_t taken = _taken(cur);
+                core->count += taken;
+                if (!_word.compare_exchange_strong(cur, reinterpret_cast<std::uint64_t>(core) | (cur & mark_bit)))
+                    core->count -= taken;
+            }
+            return _adopt(core);
+        }
+
+        void store(pointer desired) {
+            exchange(std::move(desired));
+        }
+
+        pointer exchange(pointer desired) {
+            std::uint64_t old = _word.exchange(_reserve(desired), std::memory_order_acq_rel);
+            Core* core = _core(old);
+            if (core == nullptr)
+                return pointer();
+            // keep one of the untaken references for the caller
+            _release(core, reserved - _taken(old) - 1);
+            return _adopt(core);
+        }
+
+        // Replaces the stored value with `desired` if it holds the same object
+        // as `expected` and is not marked; otherwise loads the current value
+        // into `expected`.
+        bool compare_exchange_strong(pointer& expected, pointer desired) {
+            std::uint64_t next = _reserve(desired);
+            std::uint64_t cur = _word.load(std::memory_order_acquire);
+            while (_core(cur) == expected.core && !(cur & mark_bit)) {
+                if (_word.compare_exchange_weak(cur, next, std::memory_order_acq_rel,
+                                                std::memory_order_acquire)) {
+                    // expected still holds a reference, this never frees
+                    _release(_core(cur), reserved - _taken(cur));
+                    return true;
+                }
+            }
+            _release(_core(next), reserved);
+            expected = load();
+            return false;
+        }
+
+        // Marks the stored value if it is still `expected` and unmarked;
+        // returns whether this call set the mark.
+        bool try_mark(const pointer& expected) {
+            std::uint64_t cur = _word.load(std::memory_order_acquire);
+            while (_core(cur) == expected.core && !(cur & mark_bit)) {
+                if (_word.compare_exchange_weak(cur, cur | mark_bit, std::memory_order_acq_rel,
+                                                std::memory_order_acquire))
+                    return true;
+            }
+            return false;
+        }
+
+        bool is_marked() const {
+            return _word.load(std::memory_order_acquire) & mark_bit;
+        }
+
+        operator pointer() const {
+            return load();
+        }
+
+        atomic_smart_pointer& operator=(pointer desired) {
+            store(std::move(desired));
+            return *this;
+        }
     };
 }  // namespace smart_pointer
\ No newline at end of file
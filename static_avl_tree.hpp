@@ -0,0 +1,506 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <type_traits>
+#include "smart_ptr.hpp"
+
+/**
+ * Fixed-capacity avl_tree: nodes live in an array inside the object and link
+ * to each other by index, so nothing is allocated after construction. insert
+ * into a full tree returns end(). Iterators behave like avl_tree's: one whose
+ * element was erased continues from its key.
+ * \param Key The key type. The type (class) must provide a 'less than' operator
+ * \param T The Data type
+ * \param size_type Container size type, the type of the node indices
+ * \param Size Container size, the maximum number of elements
+ * \param Fast If true every node stores an extra parent index. This increases memory but iterators step
+ *             to the neighbour through it instead of searching again from the root
+ * \param Policy smart_pointer::multi_threaded, or smart_pointer::single_threaded for no locking at all
+ */
+template<typename Key, typename T, typename size_type = std::uint32_t, size_type Size = 1024, bool Fast = false,
+         typename Policy = smart_pointer::multi_threaded>
+class static_avl_tree
+{
+    static_assert(std::is_unsigned_v<size_type>, "size_type must be an unsigned integer");
+    static_assert(Size < std::numeric_limits<size_type>::max(), "Size must leave room for the null index");
+
+    // null index
+    static constexpr size_type npos = Size;
+    // an AVL tree of n nodes is at most 1.44 log2(n) high
+    static constexpr int max_height = 3 * std::numeric_limits<size_type>::digits / 2 + 2;
+
+    struct parent_link {
+        size_type parent;
+    };
+    struct no_parent_link {};
+
+    struct node : std::conditional_t<Fast, parent_link, no_parent_link> {
+        Key key;
+        T value;
+        // free nodes are chained through `left`
+        size_type left;
+        size_type right;
+        std::int8_t height;
+        bool used;
+    };
+
+    using mutex_type = typename Policy::mutex_type;
+    std::array<node, Size> _nodes;
+    size_type _root = npos;
+    size_type _free = npos;
+    size_type _size = 0;
+    mutable mutex_type _mutex;
+
+    static bool _equal(const Key& a, const Key& b) {
+        return !(a < b) && !(b < a);
+    }
+
+    // holds the tree's read lock, so the element stays put, for as long as it lives
+    class value_guard
+    {
+        std::shared_lock<mutex_type> _lock;
+        const node* _node;
+
+    public:
+        value_guard(std::shared_lock<mutex_type> lock, const node& n)
+                : _lock(std::move(lock)), _node(&n)
+        { }
+
+        const T& operator*() const {
+            return _node->value;
+        }
+
+        const T* operator->() const {
+            return &_node->value;
+        }
+
+        const Key& key() const {
+            return _node->key;
+        }
+    };
+
+    // iterator class
+    typedef class tag_static_avl_tree_iterator
+    {
+        friend static_avl_tree;
+
+        size_type _index;
+        // position, to find the neighbours once the element itself is gone
+        Key _key;
+        static_avl_tree& _tree;
+
+        // the element is still where the iterator left it
+        bool _valid() const {
+            return _index != npos && _tree._nodes[_index].used && _equal(_tree._nodes[_index].key, _key);
+        }
+
+        void _assign(size_type i) {
+            _index = i;
+            if (i != npos)
+                _key = _tree._nodes[i].key;
+        }
+
+    public:
+        tag_static_avl_tree_iterator(static_avl_tree& tree, size_type index)
+                : _index(index), _key(index != npos ? tree._nodes[index].key : Key()), _tree(tree)
+        { }
+
+        tag_static_avl_tree_iterator& operator=(const tag_static_avl_tree_iterator& other) {
+            _index = other._index;
+            _key = other._key;
+            return *this;
+        }
+
+        bool operator==(const tag_static_avl_tree_iterator& rhs) const {
+            return _index == rhs._index;
+        }
+
+        bool operator!=(const tag_static_avl_tree_iterator& rhs) const {
+            return _index != rhs._index;
+        }
+
+        // The accessors throw smart_pointer::exception if the element was
+        // erased. The reference from operator* and val() is not covered by
+        // the tree lock: an erase or a write to the same value while the
+        // caller uses it is a race, use load() or guard() then.
+
+        // dereference - access value
+        T& operator*() const {
+            std::shared_lock<mutex_type> lock(_tree._mutex);
+            if (!_valid())
+                throw smart_pointer::exception();
+            return _tree._nodes[_index].value;
+        }
+
+        T& val() const {
+            return **this;
+        }
+
+        // copy of the value taken under the tree's read lock
+        T load() const {
+            std::shared_lock<mutex_type> lock(_tree._mutex);
+            if (!_valid())
+                throw smart_pointer::exception();
+            return _tree._nodes[_index].value;
+        }
+
+        // reference to the value that keeps the tree's read lock until the
+        // guard is destroyed
+        value_guard guard() const {
+            std::shared_lock<mutex_type> lock(_tree._mutex);
+            if (!_valid())
+                throw smart_pointer::exception();
+            return value_guard(std::move(lock), _tree._nodes[_index]);
+        }
+
+        const Key& key() const {
+            return _key;
+        }
+
+        // preincrement
+        tag_static_avl_tree_iterator& operator++() {
+            std::shared_lock<mutex_type> lock(_tree._mutex);
+            if (_index == npos) return *this;
+            if constexpr (Fast) {
+                if (_valid()) {
+                    _assign(_tree._next(_index));
+                    return *this;
+                }
+            }
+            _assign(_tree._upper_bound(_key));
+            return *this;
+        }
+
+        // postincrement
+        const tag_static_avl_tree_iterator operator++(int) {
+            tag_static_avl_tree_iterator _copy = *this;
+            ++(*this);
+            return _copy;
+        }
+
+        // predecrement, end() steps to the last element
+        tag_static_avl_tree_iterator& operator--() {
+            std::shared_lock<mutex_type> lock(_tree._mutex);
+            if (_index == npos) {
+                _assign(_tree._root == npos ? npos : _tree._findmax(_tree._root));
+                return *this;
+            }
+            if constexpr (Fast) {
+                if (_valid()) {
+                    _assign(_tree._prev(_index));
+                    return *this;
+                }
+            }
+            _assign(_tree._predecessor(_key));
+            return *this;
+        }
+
+        const tag_static_avl_tree_iterator operator--(int) {
+            tag_static_avl_tree_iterator _copy = *this;
+            --(*this);
+            return _copy;
+        }
+    } static_avl_tree_iterator;
+
+    friend tag_static_avl_tree_iterator;
+public:
+
+    typedef T                           value_type;
+    typedef Key                         key_type;
+    typedef static_avl_tree_iterator    iterator;
+
+    static_avl_tree() {
+        _reset();
+    }
+
+    static_avl_tree(const static_avl_tree&) = delete;
+    static_avl_tree& operator=(const static_avl_tree&) = delete;
+
+    iterator begin() {
+        std::shared_lock<mutex_type> lock(_mutex);
+        return iterator(*this, _root == npos ? npos : _findmin(_root));
+    }
+
+    iterator end() {
+        return iterator(*this, npos);
+    }
+
+    size_type size() const {
+        std::shared_lock<mutex_type> lock(_mutex);
+        return _size;
+    }
+
+    static constexpr size_type capacity() {
+        return Size;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    bool full() const {
+        return size() == Size;
+    }
+
+    void clear() {
+        std::unique_lock<mutex_type> lock(_mutex);
+        _reset();
+    }
+
+    iterator find(const key_type& key) {
+        std::shared_lock<mutex_type> lock(_mutex);
+        size_type i = _root;
+        while (i != npos) {
+            if (key < _nodes[i].key)
+                i = _nodes[i].left;
+            else if (_nodes[i].key < key)
+                i = _nodes[i].right;
+            else
+                break;
+        }
+        return iterator(*this, i);
+    }
+
+    // inserts (key, val) unless the key is present; returns the key's element,
+    // or end() if the tree is full
+    iterator insert(const key_type& key, const value_type& val) {
+        std::unique_lock<mutex_type> lock(_mutex);
+        size_type path[max_height];
+        int depth = 0;
+        for (size_type i = _root; i != npos; ) {
+            if (_equal(key, _nodes[i].key))
+                return iterator(*this, i);
+            path[depth++] = i;
+            i = key < _nodes[i].key ? _nodes[i].left : _nodes[i].right;
+        }
+        if (_free == npos)
+            return end();
+
+        size_type n = _free;
+        _free = _nodes[n].left;
+        _nodes[n].key = key;
+        _nodes[n].value = val;
+        _nodes[n].left = _nodes[n].right = npos;
+        _nodes[n].height = 1;
+        _nodes[n].used = true;
+        size_type parent = depth == 0 ? npos : path[depth - 1];
+        _replace_child(parent, npos, n, parent != npos && key < _nodes[parent].key);
+        _rebalance(path, depth);
+        _size++;
+        return iterator(*this, n);
+    }
+
+    bool erase(const key_type& key) {
+        std::unique_lock<mutex_type> lock(_mutex);
+        size_type path[max_height];
+        int depth = 0;
+        size_type t = _root;
+        while (t != npos && !_equal(key, _nodes[t].key)) {
+            path[depth++] = t;
+            t = key < _nodes[t].key ? _nodes[t].left : _nodes[t].right;
+        }
+        if (t == npos)
+            return false;
+
+        size_type parent = depth == 0 ? npos : path[depth - 1];
+        if (_nodes[t].left == npos || _nodes[t].right == npos) {
+            size_type child = _nodes[t].left != npos ? _nodes[t].left : _nodes[t].right;
+            _replace_child(parent, t, child, false);
+        } else {
+            // the successor takes t's place, the path runs through it instead
+            int at = depth;
+            path[depth++] = t;
+            size_type s = _nodes[t].right;
+            while (_nodes[s].left != npos) {
+                path[depth++] = s;
+                s = _nodes[s].left;
+            }
+            _replace_child(path[depth - 1], s, _nodes[s].right, false);
+            _nodes[s].left = _nodes[t].left;
+            _nodes[s].right = _nodes[t].right;
+            _set_parent(_nodes[s].left, s);
+            _set_parent(_nodes[s].right, s);
+            _replace_child(parent, t, s, false);
+            path[at] = s;
+        }
+
+        _nodes[t].value = T();
+        _nodes[t].used = false;
+        _nodes[t].left = _free;
+        _free = t;
+        _rebalance(path, depth);
+        _size--;
+        return true;
+    }
+
+    bool erase(iterator position) {
+        // end() carries no key of its own
+        if (position._index == npos)
+            return false;
+        return erase(position.key());
+    }
+
+    // Helper functions
+private:
+    void _reset() {
+        for (size_type i = 0; i < Size; ++i) {
+            _nodes[i].used = false;
+            _nodes[i].left = static_cast<size_type>(i + 1);
+        }
+        _root = npos;
+        _free = Size == 0 ? npos : 0;
+        _size = 0;
+    }
+
+    void _set_parent(size_type child, size_type parent) {
+        if constexpr (Fast) {
+            if (child != npos)
+                _nodes[child].parent = parent;
+        }
+    }
+
+    // links `to` where `from` hung below `parent` (at the root if parent is
+    // npos); when `from` is npos, `left` tells which side is empty
+    void _replace_child(size_type parent, size_type from, size_type to, bool left) {
+        if (parent == npos)
+            _root = to;
+        else if (from == npos ? left : _nodes[parent].left == from)
+            _nodes[parent].left = to;
+        else
+            _nodes[parent].right = to;
+        _set_parent(to, parent);
+    }
+
+    int _height(size_type i) const {
+        return i == npos ? 0 : _nodes[i].height;
+    }
+
+    int _balancefactor(size_type i) const {
+        return _height(_nodes[i].right) - _height(_nodes[i].left);
+    }
+
+    void _fixheight(size_type i) {
+        int hl = _height(_nodes[i].left);
+        int hr = _height(_nodes[i].right);
+        _nodes[i].height = static_cast<std::int8_t>((hl > hr ? hl : hr) + 1);
+    }
+
+    size_type _RRotation(size_type p) {
+        size_type q = _nodes[p].left;
+        _nodes[p].left = _nodes[q].right;
+        _set_parent(_nodes[p].left, p);
+        _nodes[q].right = p;
+        _set_parent(p, q);
+        _fixheight(p);
+        _fixheight(q);
+        return q;
+    }
+
+    size_type _LRotation(size_type q) {
+        size_type p = _nodes[q].right;
+        _nodes[q].right = _nodes[p].left;
+        _set_parent(_nodes[q].right, q);
+        _nodes[p].left = q;
+        _set_parent(q, p);
+        _fixheight(q);
+        _fixheight(p);
+        return p;
+    }
+
+    size_type _balance(size_type p) {
+        _fixheight(p);
+        if (_balancefactor(p) == 2) {
+            if (_balancefactor(_nodes[p].right) < 0) {
+                _nodes[p].right = _RRotation(_nodes[p].right);
+                _set_parent(_nodes[p].right, p);
+            }
+            return _LRotation(p);
+        }
+        if (_balancefactor(p) == -2) {
+            if (_balancefactor(_nodes[p].left) > 0) {
+                _nodes[p].left = _LRotation(_nodes[p].left);
+                _set_parent(_nodes[p].left, p);
+            }
+            return _RRotation(p);
+        }
+        return p;
+    }
+
+    // rebalances path[0..depth), from the bottom up to the root
+    void _rebalance(size_type* path, int depth) {
+        for (int k = depth - 1; k >= 0; --k) {
+            size_type parent = k == 0 ? npos : path[k - 1];
+            size_type r = _balance(path[k]);
+            if (r != path[k])
+                _replace_child(parent, path[k], r, false);
+        }
+    }
+
+    size_type _findmin(size_type i) const {
+        while (_nodes[i].left != npos)
+            i = _nodes[i].left;
+        return i;
+    }
+
+    size_type _findmax(size_type i) const {
+        while (_nodes[i].right != npos)
+            i = _nodes[i].right;
+        return i;
+    }
+
+    // in-order neighbours through the parent links (Fast only)
+    size_type _next(size_type i) const {
+        if (_nodes[i].right != npos)
+            return _findmin(_nodes[i].right);
+        size_type p = _nodes[i].parent;
+        while (p != npos && _nodes[p].right == i) {
+            i = p;
+            p = _nodes[p].parent;
+        }
+        return p;
+    }
+
+    size_type _prev(size_type i) const {
+        if (_nodes[i].left != npos)
+            return _findmax(_nodes[i].left);
+        size_type p = _nodes[i].parent;
+        while (p != npos && _nodes[p].left == i) {
+            i = p;
+            p = _nodes[p].parent;
+        }
+        return p;
+    }
+
+    // first element with a key greater than `key`
+    size_type _upper_bound(const key_type& key) const {
+        size_type res = npos;
+        for (size_type i = _root; i != npos; ) {
+            if (key < _nodes[i].key) {
+                res = i;
+                i = _nodes[i].left;
+            } else {
+                i = _nodes[i].right;
+            }
+        }
+        return res;
+    }
+
+    // last element with a key less than `key`
+    size_type _predecessor(const key_type& key) const {
+        size_type res = npos;
+        for (size_type i = _root; i != npos; ) {
+            if (_nodes[i].key < key) {
+                res = i;
+                i = _nodes[i].right;
+            } else {
+                i = _nodes[i].left;
+            }
+        }
+        return res;
+    }
+};